@@ -34,8 +34,10 @@ fi
 
 VALGRIND_ARGS="--show-reachable=yes --xml=yes --gen-suppressions=all --tool=memcheck --leak-check=full --track-origins=yes --fair-sched=try"
 
+# every active port runs the full list, one worker each
+$AFFINITY $ibv_test --parallel=1 --gtest_output=xml:$WORKSPACE/ibv_test.xml
+
 for dev in $(ibstat -l); do
-    env IBV_TEST_DEV=${dev} $AFFINITY $ibv_test
     module load tools/valgrind
     env IBV_TEST_DEV=${dev} $AFFINITY valgrind $VALGRIND_ARGS --xml-file=$WORKSPACE/${dev}_valgrind.xml --log-file=$WORKSPACE/${dev}_valgrind.txt $ibv_test
     module unload tools/valgrind
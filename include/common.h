@@ -40,6 +40,7 @@
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>   /* printf PRItn */
 #include <unistd.h>
+#include <dlfcn.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
@@ -47,6 +48,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sched.h>
 #include <inttypes.h>   /* printf PRItn */
 #include <fcntl.h>
 #include <poll.h>
@@ -54,6 +56,7 @@
 #include <malloc.h>
 #include <math.h>
 #include <complex.h>
+#include <string.h>
 
 #include "gtest.h"
 
@@ -68,6 +71,14 @@
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
 
+/* the next definition of an interposed libc/libibverbs function */
+#define REAL(f) ({ \
+		static __typeof__(&f) __fn; \
+		if (!__fn) \
+			__fn = (__typeof__(&f))dlsym(RTLD_NEXT, #f); \
+		__fn; \
+	})
+
 
 /* Platform specific 16-byte alignment macro switch.
    On Visual C++ it would substitute __declspec(align(16)).
@@ -102,6 +113,7 @@ enum {
 
 extern uint32_t gtest_debug_mask;
 extern char *gtest_dev_name;
+extern uint32_t gtest_ring_size;
 
 
 #define VERBS_PRINT(level, color, fmt, ...) \
@@ -111,6 +123,18 @@ extern char *gtest_dev_name;
 			       color, #level, ##__VA_ARGS__); \
 	} while(0)
 
+/* goes to the per-thread binary ring instead of stdout if IBV_TEST_RING is set */
+#define VERBS_RECORD(level, color, fmt, ...) \
+	do { \
+		if (gtest_debug_mask & GTEST_LOG_ ## level) { \
+			if (gtest_ring_size) \
+				sys_ring_record(GTEST_LOG_ ## level, fmt, ##__VA_ARGS__); \
+			else \
+				printf("\033[0;3%dm" "[ %-8s ] " fmt "\033[m", \
+				       color, #level, ##__VA_ARGS__); \
+		} \
+	} while(0)
+
 #define VERBS_ERR(fmt, ...) \
 	VERBS_PRINT(ERR, 1, fmt, ##__VA_ARGS__)
 
@@ -118,10 +142,10 @@ extern char *gtest_dev_name;
 	VERBS_PRINT(NOTICE, 3, fmt, ##__VA_ARGS__)
 
 #define VERBS_INFO(fmt, ...) \
-	VERBS_PRINT(INFO, 4, fmt, ##__VA_ARGS__)
+	VERBS_RECORD(INFO, 4, fmt, ##__VA_ARGS__)
 
 #define VERBS_TRACE(fmt, ...) \
-	VERBS_PRINT(TRACE, 7, fmt, ##__VA_ARGS__)
+	VERBS_RECORD(TRACE, 7, fmt, ##__VA_ARGS__)
 
 #define CHECK_TEST_OR_SKIP(FEATURE_NAME) \
 	do{\
@@ -135,6 +159,20 @@ extern char *gtest_dev_name;
 
 void sys_hexdump(void *ptr, int buflen);
 uint32_t sys_inet_addr(char* ip);
+const char *sys_pattern_isa(void);
+void sys_fill_pattern(char *buf, size_t start, size_t end, size_t shift);
+size_t sys_check_pattern(const char *buf, size_t start, size_t end, size_t shift);
+int sys_parallel(int *argc, char **argv, int *rc);
+double sys_tsc_per_us(void);
+int sys_pin_cpu(int n);
+int sys_pin_cpus(const cpu_set_t *set);
+int sys_pin_reset(void);
+int sys_read_list(const char *path, cpu_set_t *set);
+int sys_mems_allowed(cpu_set_t *set);
+int sys_numa_remote(int node);
+int sys_mbind(void *addr, size_t len, int node);
+extern void (*sys_unmap_hook)(void *addr, size_t len);
+int sys_ring_decode(int argc, char **argv);
 
 
 static INLINE void sys_getenv(void)
@@ -147,6 +185,10 @@ static INLINE void sys_getenv(void)
 
 	env = getenv("IBV_TEST_DEV");
 	gtest_dev_name = strdup(env ? env : "mlx");
+
+	env = getenv("IBV_TEST_RING");
+	if (env)
+		gtest_ring_size = strtoul(env, NULL, 0);
 }
 
 static INLINE int sys_is_big_endian(void)
@@ -194,4 +236,111 @@ static INLINE uint64_t sys_rdtsc(void)
 
 	return (result);
 }
+
+/*
+ * Binary trace ring: one mmap-ed file per thread, ibv_test.<pid>.<tid>.ring,
+ * holding fixed size records. Only the owner thread writes, so recording
+ * is a few stores; "ibv_test --ring-decode FILE..." prints them back.
+ */
+#define SYS_RING_ARGS 8
+#define SYS_RING_STR 40
+
+struct sys_ring_rec {
+	uint64_t tsc;
+	const char *fmt;
+	uint8_t level;
+	uint8_t nargs;
+	uint8_t str_used;
+	uint8_t pad[5];
+	uint64_t arg[SYS_RING_ARGS];
+	char str[SYS_RING_STR];
+};
+
+struct sys_ring_hdr {
+	char magic[8];
+	char stamp[32];
+	uint64_t anchor;
+	double tsc_per_us;
+	uint64_t size;
+	uint64_t head;
+	uint64_t tid;
+	uint64_t pad[3];
+};
+
+struct sys_ring {
+	struct sys_ring_hdr *hdr;
+	struct sys_ring_rec *recs;
+};
+
+extern __thread struct sys_ring *sys_ring_self;
+struct sys_ring *sys_ring_open(void);
+
+static INLINE void sys_ring_arg(struct sys_ring_rec *r, int i, const char *v)
+{
+	size_t len = v ? strnlen(v, SYS_RING_STR) : 0;
+
+	if (r->str_used + len >= SYS_RING_STR) {
+		r->arg[i] = UINT64_MAX;
+		return;
+	}
+	r->arg[i] = r->str_used;
+	memcpy(r->str + r->str_used, v, len);
+	r->str_used += len;
+	r->str[r->str_used++] = 0;
+}
+
+static INLINE void sys_ring_arg(struct sys_ring_rec *r, int i, char *v)
+{
+	sys_ring_arg(r, i, (const char *)v);
+}
+
+static INLINE void sys_ring_arg(struct sys_ring_rec *r, int i, double v)
+{
+	memcpy(&r->arg[i], &v, sizeof(v));
+}
+
+static INLINE void sys_ring_arg(struct sys_ring_rec *r, int i, float v)
+{
+	sys_ring_arg(r, i, (double)v);
+}
+
+template <typename T>
+static INLINE void sys_ring_arg(struct sys_ring_rec *r, int i, T *v)
+{
+	r->arg[i] = (uintptr_t)v;
+}
+
+template <typename T>
+static INLINE void sys_ring_arg(struct sys_ring_rec *r, int i, T v)
+{
+	r->arg[i] = (uint64_t)v;
+}
+
+static INLINE void sys_ring_args(struct sys_ring_rec *r, int i) { }
+
+template <typename T, typename... A>
+static INLINE void sys_ring_args(struct sys_ring_rec *r, int i, T v, A... a)
+{
+	if (i < SYS_RING_ARGS)
+		sys_ring_arg(r, i, v);
+	sys_ring_args(r, i + 1, a...);
+}
+
+template <typename... A>
+static INLINE void sys_ring_record(int level, const char *fmt, A... a)
+{
+	struct sys_ring *ring = sys_ring_self ? sys_ring_self : sys_ring_open();
+	struct sys_ring_rec *r;
+
+	if (!ring)
+		return;
+	r = &ring->recs[ring->hdr->head & (ring->hdr->size - 1)];
+	r->tsc = sys_rdtsc();
+	r->fmt = fmt;
+	r->level = level;
+	r->nargs = sizeof...(a);
+	r->str_used = 0;
+	sys_ring_args(r, 0, a...);
+	__atomic_store_n(&ring->hdr->head, ring->hdr->head + 1, __ATOMIC_RELEASE);
+}
 #endif //_IBVERBS_COMMON_H_
@@ -40,6 +40,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -47,6 +48,11 @@
 #include <dirent.h>
 #include <linux/limits.h>
 
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
 #include <infiniband/verbs.h>
 
 #if HAVE_INFINIBAND_VERBS_EXP_H
@@ -131,6 +137,7 @@
 #define ibv_peer_buf		       ibv_exp_peer_buf
 #define ibv_peer_buf_alloc_attr	       ibv_exp_peer_buf_alloc_attr
 #define IBV_SEND_SIGNALED	       IBV_EXP_SEND_SIGNALED
+#define IBV_SEND_INLINE		       IBV_EXP_SEND_INLINE
 
 #define ibv_create_cq_ex_(ctx, attr, n, ch) \
 		ibv_exp_create_cq(ctx, n, NULL, ch, 0, attr)
@@ -198,7 +205,8 @@
 #define ibv_create_cq_ex_(ctx, attr, n, ch) ({ \
 		(attr)->cqe = n; \
 		(attr)->channel = ch; \
-		(attr)->wc_flags = IBV_CREATE_CQ_SUP_WC_FLAGS; \
+		if (!(attr)->wc_flags) \
+			(attr)->wc_flags = IBV_CREATE_CQ_SUP_WC_FLAGS; \
 		SET_IGNORE_OVERRUN(attr) \
 		ibv_cq_ex_to_cq(ibv_create_cq_ex(ctx, attr)); })
 
@@ -222,16 +230,22 @@ extern "C" {
 
 #define PAGE 0x1000
 #define UP (1ULL<<47)
+#define WC_FLUSH() asm volatile("sfence" ::: "memory")
+#define DMA_WMB() asm volatile("" ::: "memory")
 
 #elif (__ppc64__|__PPC64__)
 
 #define PAGE 0x10000
 #define UP (1ULL<<46)
+#define WC_FLUSH() asm volatile("sync" ::: "memory")
+#define DMA_WMB() asm volatile("sync" ::: "memory")
 
 #elif __aarch64__
 
 #define PAGE 0x1000
 #define UP (1ULL<<47)
+#define WC_FLUSH() asm volatile("dsb st" ::: "memory")
+#define DMA_WMB() asm volatile("dmb oshst" ::: "memory")
 
 #else
 
@@ -243,22 +257,41 @@ extern "C" {
 #define PAGE_ALIGN(x) ((x) & ~PAGE_MASK)
 #define PAGE_UPALIGN(x) (((x) + PAGE_MASK) & ~PAGE_MASK)
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define HUGE_2M (1UL << 21)
+#define HUGE_1G (1UL << 30)
+
 
 #include "common.h"
 
+/* per call site rdtsc histograms, enabled by IBV_TEST_PROFILE */
+#define PROF_START() \
+	uint64_t prof_t0_ = this->env.profile ? sys_rdtsc() : 0
+
+#define PROF_END(x) do { \
+		if (prof_t0_) \
+			this->env.prof_add(#x, __LINE__, sys_rdtsc() - prof_t0_); \
+	} while(0)
+
 #define EXEC(x) do { \
 		VERBS_TRACE("%3d.%p: execute\t%s" #x "\n", __LINE__, this, this->env.lvl_str); \
+		PROF_START(); \
 		this->env.lvl_str[this->env.lvl++] = ' '; \
 		ASSERT_NO_FATAL_FAILURE(this->x); \
 		this->env.lvl_str[--this->env.lvl] = 0; \
+		PROF_END(x); \
 	} while(0)
 
 #define INIT(x) do { \
 		if (!this->env.skip) { \
 			VERBS_TRACE("%3d.%p: initialize\t%s" #x "\n", __LINE__, this, this->env.lvl_str); \
+			PROF_START(); \
 			this->env.lvl_str[this->env.lvl++] = ' '; \
 			EXPECT_NO_FATAL_FAILURE(this->x); \
 			this->env.lvl_str[--this->env.lvl] = 0; \
+			PROF_END(x); \
 			if (this->env.skip) { \
 				VERBS_TRACE("%3d.%p: failed\t%s" #x " - skipping test\n", __LINE__, this, this->env.lvl_str); \
 				return; \
@@ -268,13 +301,16 @@ extern "C" {
 
 #define EXECL(x) do { \
 		VERBS_TRACE("%3d.%p: execute\t%s" #x "\n", __LINE__, this, this->env.lvl_str); \
+		PROF_START(); \
 		this->env.lvl_str[this->env.lvl++] = ' '; \
 		ASSERT_NO_FATAL_FAILURE(x); \
 		this->env.lvl_str[--this->env.lvl] = 0; \
+		PROF_END(x); \
 	} while(0)
 
 #define DO(x) do { \
 		VERBS_TRACE("%3d.%p: doing\t%s" #x "\n", __LINE__, this, this->env.lvl_str); \
+		PROF_START(); \
 		if (this->env.run) \
 			ASSERT_EQ(0, x) << "errno: " << errno; \
 		else if (x) { \
@@ -282,11 +318,14 @@ extern "C" {
 			this->env.skip = 1; \
 			return; \
 		} \
+		PROF_END(x); \
 	} while(0)
 
 #define SET(x,y) do { \
 		VERBS_TRACE("%3d.%p: doing\t%s" #y "\n", __LINE__, this, this->env.lvl_str); \
+		PROF_START(); \
 		x=y; \
+		PROF_END(y); \
 		if (this->env.run) \
 			ASSERT_TRUE(x) << #y << " errno: " << errno; \
 		else if (!x) { \
@@ -335,6 +374,9 @@ extern "C" {
 
 #define DC_KEY 1
 
+#define CACHE_LINE 64
+#define WR_ARENA_SIZE (1 << 20)
+
 static void hexdump(const char *pfx, void *buff, size_t len)  __attribute__ ((unused));
 static void hexdump(const char *pfx, void *buff, size_t len) {
 	unsigned char *p = (unsigned char*)buff, *end = (unsigned char*)buff + len, c;
@@ -350,6 +392,39 @@ static void hexdump(const char *pfx, void *buff, size_t len) {
 	}
 }
 
+/* log2 histogram of rdtsc deltas */
+struct ibvt_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[64];
+
+	ibvt_hist() : count(0), sum(0), min(UINT64_MAX), max(0) {
+		memset(bucket, 0, sizeof(bucket));
+	}
+
+	void add(uint64_t t) {
+		count++;
+		sum += t;
+		min = std::min(min, t);
+		max = std::max(max, t);
+		bucket[t ? 63 - __builtin_clzll(t) : 0]++;
+	}
+
+	/* upper bound of the bucket holding the p-th percentile */
+	uint64_t percentile(double p) {
+		uint64_t n = 0;
+
+		for (int i = 0; i < 64; i++) {
+			n += bucket[i];
+			if (n && n >= p / 100 * count)
+				return std::min<uint64_t>(max, (2ULL << i) - 1);
+		}
+		return max;
+	}
+};
+
 struct ibvt_env {
 	ibvt_env &env;
 	char lvl_str[256];
@@ -365,6 +440,45 @@ struct ibvt_env {
 	struct ibv_send_wr *wr_list;
 	struct ibv_send_wr *wr_list_end;
 
+	char *wr_arena;
+	size_t wr_arena_used;
+	long wr_arena_hits;
+	long wr_heap;
+
+	int recycle;
+
+	int profile;
+	std::map<std::pair<const char *, int>, ibvt_hist> prof;
+
+	void prof_add(const char *expr, int line, uint64_t t) {
+		prof[std::make_pair(expr, line)].add(t);
+	}
+
+	virtual void prof_dump() {
+		std::vector<std::pair<uint64_t, std::pair<const char *, int> > > sites;
+		double tsc = sys_tsc_per_us();
+
+		if (prof.empty())
+			return;
+		for (std::map<std::pair<const char *, int>, ibvt_hist>::iterator i = prof.begin();
+		     i != prof.end(); i++)
+			sites.push_back(std::make_pair(i->second.sum, i->first));
+		std::sort(sites.rbegin(), sites.rend());
+
+		VERBS_NOTICE("%8s %8s %10s %9s %9s %9s %9s  %s\n", "line", "count",
+			     "total us", "avg us", "p50 us", "p99 us", "max us", "step");
+		for (size_t i = 0; i < sites.size(); i++) {
+			ibvt_hist &h = prof[sites[i].second];
+
+			VERBS_NOTICE("%8d %8" PRIu64 " %10.1f %9.2f %9.2f %9.2f %9.2f  %s\n",
+				     sites[i].second.second, h.count, h.sum / tsc,
+				     h.sum / tsc / h.count, h.percentile(50) / tsc,
+				     h.percentile(99) / tsc, h.max / tsc,
+				     sites[i].second.first);
+		}
+		prof.clear();
+	}
+
 	void init_ram() {
 		int fd = open("/proc/meminfo", O_RDONLY);
 		ASSERT_GT(fd, 0);
@@ -393,12 +507,41 @@ struct ibvt_env {
 		wr_list_end = wr;
 	}
 
+	/* WRs are carved from a cache-line aligned arena which is reset
+	 * after every post; calloc is only a fallback when it is full. */
+	virtual void *alloc_wr(size_t size) {
+		size_t len = (size + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+		void *wr;
+
+		if (!wr_arena && posix_memalign((void **)&wr_arena, CACHE_LINE, WR_ARENA_SIZE))
+			wr_arena = NULL;
+		if (wr_arena && wr_arena_used + len <= WR_ARENA_SIZE) {
+			wr = wr_arena + wr_arena_used;
+			wr_arena_used += len;
+			wr_arena_hits++;
+			memset(wr, 0, size);
+			return wr;
+		}
+		wr_heap++;
+		return calloc(1, size);
+	}
+
+	bool in_wr_arena(void *wr) {
+		return wr_arena && (char *)wr >= wr_arena &&
+		       (char *)wr < wr_arena + WR_ARENA_SIZE;
+	}
+
 	virtual void free_wr() {
-		while (wr_list) {
+		while (wr_heap && wr_list) {
 			struct ibv_send_wr *wr = wr_list;
 			wr_list = wr_list->next;
-			free(wr);
+			if (!in_wr_arena(wr)) {
+				free(wr);
+				wr_heap--;
+			}
 		}
+		wr_list = NULL;
+		wr_arena_used = 0;
 	}
 
 	ibvt_env() :
@@ -409,10 +552,26 @@ struct ibvt_env {
 		flags(ACTIVE),
 		run(0),
 		ram_init(0),
-		wr_list(NULL)
+		wr_list(NULL),
+		wr_arena(NULL),
+		wr_arena_used(0),
+		wr_arena_hits(0),
+		wr_heap(0),
+		recycle(0),
+		profile(!!getenv("IBV_TEST_PROFILE"))
 	{
 		memset(lvl_str, 0, sizeof(lvl_str));
 	}
+
+	virtual ~ibvt_env() {
+		/* fixtures dump from TearDown(), this only catches the rest */
+		prof_dump();
+		free_wr();
+		if (wr_arena_hits)
+			VERBS_INFO("wr arena: %ld allocations avoided\n",
+				   wr_arena_hits);
+		free(wr_arena);
+	}
 };
 
 struct ibvt_obj {
@@ -423,6 +582,122 @@ struct ibvt_obj {
 	virtual void init() = 0;
 };
 
+/* Process-wide device probe and context cache. The device list and
+ * device attributes are queried once, port state is queried again on
+ * every attach; opened contexts are kept until exit so that later
+ * fixtures only attach to them. */
+struct ibvt_ctx_cache {
+	struct dev {
+		struct ibv_device *dev;
+		struct ibv_context *probe_ctx;
+		struct ibv_device_attr_ex dev_attr;
+		struct ibv_device_attr *dev_attr_orig;
+		int query_ret;
+		std::map<int, struct ibv_context *> ctx;
+		std::map<int, int> refs;
+	};
+
+	struct ibv_device **dev_list;
+	int num_devices;
+	std::vector<dev> devs;
+	int probed;
+	int disabled;
+	long attaches;
+	double probe_time;
+	pthread_mutex_t lock;
+
+	ibvt_ctx_cache() :
+		dev_list(NULL),
+		num_devices(0),
+		probed(0),
+		disabled(!!getenv("IBV_TEST_NO_CTX_CACHE")),
+		attaches(0),
+		probe_time(0)
+	{
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	~ibvt_ctx_cache() {
+		if (probed)
+			VERBS_INFO("ctx cache: probe %.0f usec, %ld attaches\n",
+				   probe_time, attaches);
+		for (size_t i = 0; i < devs.size(); i++) {
+			std::map<int, struct ibv_context *>::iterator it;
+			for (it = devs[i].ctx.begin(); it != devs[i].ctx.end(); it++)
+				ibv_close_device(it->second);
+			if (devs[i].probe_ctx && !devs[i].ctx.count(0))
+				ibv_close_device(devs[i].probe_ctx);
+		}
+		if (dev_list)
+			ibv_free_device_list(dev_list);
+		pthread_mutex_destroy(&lock);
+	}
+
+	void probe() {
+		double start = sys_gettime();
+
+		dev_list = ibv_get_device_list(&num_devices);
+		devs.resize(dev_list ? num_devices : 0);
+		for (size_t devn = 0; devn < devs.size(); devn++) {
+			dev &d = devs[devn];
+
+			d.dev = dev_list[devn];
+			d.probe_ctx = ibv_open_device(d.dev);
+			if (!d.probe_ctx)
+				continue;
+			memset(&d.dev_attr, 0, sizeof(d.dev_attr));
+			d.query_ret = ibv_query_device_(d.probe_ctx, &d.dev_attr,
+							d.dev_attr_orig);
+			d.ctx[0] = d.probe_ctx;
+			d.refs[0] = 0;
+		}
+		probed = 1;
+		probe_time = sys_gettime() - start;
+	}
+
+	void lock_probe() {
+		pthread_mutex_lock(&lock);
+		if (!probed)
+			probe();
+		pthread_mutex_unlock(&lock);
+	}
+
+	template <typename Ctx>
+	struct ibv_context *get(size_t devn, int flags, Ctx &c) {
+		struct ibv_context *res;
+		dev &d = devs[devn];
+
+		pthread_mutex_lock(&lock);
+		if (!d.ctx.count(flags)) {
+			res = c.open_device(d.dev);
+			if (res) {
+				d.ctx[flags] = res;
+				d.refs[flags] = 0;
+			}
+		}
+		res = d.ctx.count(flags) ? d.ctx[flags] : NULL;
+		if (res) {
+			d.refs[flags]++;
+			attaches++;
+		}
+		pthread_mutex_unlock(&lock);
+		return res;
+	}
+
+	void put(struct ibv_device *ibdev, int flags) {
+		pthread_mutex_lock(&lock);
+		for (size_t i = 0; i < devs.size(); i++)
+			if (devs[i].dev == ibdev)
+				devs[i].refs[flags]--;
+		pthread_mutex_unlock(&lock);
+	}
+};
+
+inline ibvt_ctx_cache &ctx_cache() {
+	static ibvt_ctx_cache cache;
+	return cache;
+}
+
 struct ibvt_ctx : public ibvt_obj {
 	struct ibv_context *ctx;
 	ibvt_ctx *other;
@@ -435,6 +710,11 @@ struct ibvt_ctx : public ibvt_obj {
 	union ibv_gid gid;
 	char *pdev_name;
 	char *vdev_name;
+	int cached;
+	int cache_flags;
+	int numa_node;
+	int mem_node;
+	int cpu;
 
 #if HAVE_INFINIBAND_VERBS_EXP_H
 
@@ -538,7 +818,12 @@ struct ibvt_ctx : public ibvt_obj {
 		other(o),
 		port_num(0),
 		pdev_name(NULL),
-		vdev_name(NULL)	{}
+		vdev_name(NULL),
+		cached(0),
+		cache_flags(0),
+		numa_node(-1),
+		mem_node(-1),
+		cpu(-1) {}
 
 	virtual bool check_port(struct ibv_device *dev) {
 		if (getenv("IBV_DEV") && strcmp(ibv_get_device_name(dev), getenv("IBV_DEV")))
@@ -549,6 +834,66 @@ struct ibvt_ctx : public ibvt_obj {
 	}
 
 
+	/*
+	 * IBV_TEST_NUMA=local binds MR memory to the device's NUMA node and
+	 * pins the test thread to a CPU of its local_cpulist, =remote uses
+	 * another node for both to measure the cross-socket penalty.
+	 */
+	virtual void init_numa() {
+		const char *mode = getenv("IBV_TEST_NUMA");
+		char path[PATH_MAX];
+		cpu_set_t cpus, mems;
+		FILE *f;
+
+		if (!ctx || !mode || !*mode)
+			return;
+		sprintf(path, "/sys/class/infiniband/%s/device/numa_node",
+			ibv_get_device_name(dev));
+		f = fopen(path, "r");
+		if (f) {
+			if (fscanf(f, "%d", &numa_node) != 1)
+				numa_node = -1;
+			fclose(f);
+		}
+
+		if (!strcmp(mode, "remote")) {
+			mem_node = numa_node < 0 ? -1 : sys_numa_remote(numa_node);
+			if (mem_node < 0) {
+				VERBS_NOTICE("no NUMA node remote to %s - skipping test\n",
+					     ibv_get_device_name(dev));
+				env.skip = 1;
+				return;
+			}
+			sprintf(path, "/sys/devices/system/node/node%d/cpulist",
+				mem_node);
+		} else {
+			mem_node = numa_node;
+			sprintf(path, "/sys/class/infiniband/%s/device/local_cpulist",
+				ibv_get_device_name(dev));
+			if (mem_node >= 0 && sys_mems_allowed(&mems) > 0 &&
+			    !CPU_ISSET(mem_node, &mems)) {
+				VERBS_NOTICE("NUMA node %d is outside the cpuset - skipping test\n",
+					     mem_node);
+				env.skip = 1;
+				return;
+			}
+		}
+		if (sys_read_list(path, &cpus) > 0 && !sys_pin_cpus(&cpus))
+			cpu = sys_pin_cpu(0);
+		VERBS_INFO("numa: %s on node %d, memory on node %d, cpu %d\n",
+			   ibv_get_device_name(dev), numa_node, mem_node, cpu);
+	}
+
+	/* an in-process IBV_TEST_LOOPBACK device, see src/loopback.cc */
+	bool loopback() {
+		return dev && !strncmp(ibv_get_device_name(dev), "loopback", 8);
+	}
+
+	/* set by --parallel workers to stick to one port */
+	bool check_port_num(int port) {
+		return !getenv("IBV_TEST_PORT") || atoi(getenv("IBV_TEST_PORT")) == port;
+	}
+
 	int grh_required() {
 		return port_attr.link_layer == IBV_LINK_LAYER_ETHERNET;
 	}
@@ -557,11 +902,67 @@ struct ibvt_ctx : public ibvt_obj {
 		return ibv_open_device(ibdev);
 	}
 
+	/* contexts are shared through the cache per device and open flags */
+	virtual int open_flags() { return 0; }
+
 	virtual void init() {
-		struct ibv_device **dev_list = NULL;
-		int num_devices;
+		ibvt_ctx_cache &cache = ctx_cache();
 		if (ctx)
 			return;
+		if (cache.disabled) {
+			EXEC(init_nocache());
+			EXEC(init_numa());
+			return;
+		}
+
+		cache.lock_probe();
+		for (size_t devn = 0; devn < cache.devs.size(); devn++) {
+			ibvt_ctx_cache::dev &d = cache.devs[devn];
+
+			if (getenv("IBV_DEV") && strcmp(ibv_get_device_name(d.dev), getenv("IBV_DEV")))
+				continue;
+			if (other && other->dev == d.dev)
+				continue;
+			if (!d.probe_ctx)
+				continue;
+			DO(d.query_ret);
+			dev_attr = d.dev_attr;
+			dev_attr_orig = (struct ibv_device_attr *)
+				((char *)&dev_attr +
+				 ((char *)d.dev_attr_orig - (char *)&d.dev_attr));
+			/* cheap, and a port may go down or change LID mid-run */
+			for (int port = 1; port <= dev_attr_orig->phys_port_cnt; port++) {
+				DO(ibv_query_port(d.probe_ctx, port, &port_attr));
+				if (!check_port(d.dev) || !check_port_num(port))
+					continue;
+
+				port_num = port;
+				lid = port_attr.lid;
+				DO(ibv_query_gid(d.probe_ctx, port_num, 0, &gid));
+				break;
+			}
+			if (!port_num)
+				continue;
+			cache_flags = open_flags();
+			ctx = cache.get(devn, cache_flags, *this);
+			if (ctx) {
+				cached = 1;
+				dev = d.dev;
+				VERBS_INFO("dev %s\n", ibv_get_device_name(dev));
+				break;
+			}
+			port_num = 0;
+		}
+		if (!port_num) {
+			VERBS_NOTICE("suitable port not found\n");
+			env.skip = 1;
+		}
+		EXEC(init_numa());
+	}
+
+	virtual void init_nocache() {
+		struct ibv_device **dev_list = NULL;
+		int num_devices;
 
 		dev_list = ibv_get_device_list(&num_devices);
 		for (int devn = 0; devn < num_devices; devn++) {
@@ -576,7 +977,7 @@ struct ibvt_ctx : public ibvt_obj {
 			DO(ibv_query_device_(ctx, &dev_attr, dev_attr_orig));
 			for (int port = 1; port <= dev_attr_orig->phys_port_cnt; port++) {
 				DO(ibv_query_port(ctx, port, &port_attr));
-				if (!check_port(dev_list[devn]))
+				if (!check_port(dev_list[devn]) || !check_port_num(port))
 					continue;
 
 				port_num = port;
@@ -602,7 +1003,14 @@ struct ibvt_ctx : public ibvt_obj {
 	}
 
 	virtual ~ibvt_ctx() {
-		FREE(ibv_close_device, ctx);
+		/* init_numa() pinned this thread, later tests start unpinned */
+		if (cpu >= 0)
+			sys_pin_reset();
+		if (cached)
+			/* open_flags() is no longer the derived one here */
+			ctx_cache().put(dev, cache_flags);
+		else
+			FREE(ibv_close_device, ctx);
 	}
 };
 
@@ -620,12 +1028,383 @@ struct ibvt_ctx_devx : public ibvt_ctx {
 
 		return res;
 	}
+
+	virtual int open_flags() { return MLX5DV_CONTEXT_FLAGS_DEVX; }
 };
 #endif
 
+/* Opt-in pool of PDs, CQs, QPs and MRs recycled between fixtures which
+ * set ibvt_env::recycle, enabled with IBV_TEST_RECYCLE=1. Objects are
+ * keyed by their creation attributes; QPs are parked in RESET state and
+ * walked up again by connect(). It relies on the shared contexts of
+ * ibvt_ctx_cache. */
+struct ibvt_pool {
+	enum {
+		POOL_MR,
+		POOL_QP,
+		POOL_CQ,
+		POOL_PD,
+		POOL_MAX
+	};
+
+	struct mr_entry {
+		struct ibv_mr *mr;
+		char *mem;
+		size_t mem_size;
+	};
+
+	std::multimap<std::string, void *> objs[POOL_MAX];
+	std::multimap<std::string, mr_entry> mrs;
+	int enabled;
+	long hits;
+	long misses;
+
+	ibvt_pool() :
+		enabled(getenv("IBV_TEST_RECYCLE") && !ctx_cache().disabled),
+		hits(0),
+		misses(0) {}
+
+	~ibvt_pool() {
+		std::multimap<std::string, mr_entry>::iterator mi;
+		std::multimap<std::string, void *>::iterator it;
+
+		if (hits || misses)
+			VERBS_NOTICE("pool: %ld objects recycled, %ld created\n",
+				     hits, misses);
+		for (mi = mrs.begin(); mi != mrs.end(); mi++) {
+			ibv_dereg_mr(mi->second.mr);
+			munmap(mi->second.mem, mi->second.mem_size);
+		}
+		for (it = objs[POOL_QP].begin(); it != objs[POOL_QP].end(); it++)
+			ibv_destroy_qp((struct ibv_qp *)it->second);
+		for (it = objs[POOL_CQ].begin(); it != objs[POOL_CQ].end(); it++)
+			ibv_destroy_cq((struct ibv_cq *)it->second);
+		for (it = objs[POOL_PD].begin(); it != objs[POOL_PD].end(); it++)
+			ibv_dealloc_pd((struct ibv_pd *)it->second);
+	}
+
+	template <typename T>
+	static std::string key(const void *parent, const T &attr) {
+		return std::string((const char *)&parent, sizeof(parent)) +
+		       std::string((const char *)&attr, sizeof(attr));
+	}
+
+	void *get(int type, const std::string &k) {
+		std::multimap<std::string, void *>::iterator it = objs[type].find(k);
+		void *obj;
+
+		if (it == objs[type].end()) {
+			misses++;
+			return NULL;
+		}
+		obj = it->second;
+		objs[type].erase(it);
+		hits++;
+		return obj;
+	}
+
+	void put(int type, const std::string &k, void *obj) {
+		objs[type].insert(std::make_pair(k, obj));
+	}
+
+	bool get_mr(const std::string &k, mr_entry &e) {
+		std::multimap<std::string, mr_entry>::iterator it = mrs.find(k);
+
+		if (it == mrs.end()) {
+			misses++;
+			return false;
+		}
+		e = it->second;
+		mrs.erase(it);
+		hits++;
+		return true;
+	}
+
+	void put_mr(const std::string &k, const mr_entry &e) {
+		mrs.insert(std::make_pair(k, e));
+	}
+};
+
+inline ibvt_pool &pool() {
+	static ibvt_pool p;
+	return p;
+}
+
+/* Opt-in registration cache of ibvt_mr, enabled with IBV_TEST_MR_CACHE=1,
+ * like the pin-down caches of MPI and storage stacks. A registration is
+ * reused by any later request of the same PD which it covers with at
+ * least the asked permissions and the same other access bits (ON_DEMAND,
+ * HUGETLB, ZERO_BASED...); entries are reference counted, idle ones stay
+ * registered until their memory is unmapped, which sys_unmap_hook
+ * reports from munmap/mremap/madvise. Entries are ordered by start
+ * address and the longest one bounds the backward walk, which answers
+ * the interval stabbing query for the few entries tests hold.
+ *
+ * Like an application reusing its buffers, ibvt_mr parks the mapping of
+ * a cached MR here instead of unmapping it (up to MRC_PARK_MAX bytes),
+ * and a later ibvt_mr of the same size and pages at the same fixed
+ * address, or anywhere when it asks for none, takes it over. */
+#define MRC_PARK_MAX	(1UL << 30)
+
+struct ibvt_mr_cache {
+	struct entry {
+		struct ibv_pd *pd;
+		uintptr_t start;
+		uintptr_t end;
+		long access;
+		struct ibv_mr *mr;
+		int refs;
+		int stale;
+		double reg_usec;
+	};
+
+	struct mapping {
+		size_t size;
+		int pages;
+		int fixed;
+	};
+
+	std::multimap<uintptr_t, entry *> tree;
+	std::map<struct ibv_mr *, entry *> by_mr;
+	std::map<uintptr_t, mapping> maps;
+	std::map<int, std::pair<double, long> > cost;
+	size_t max_len;
+	size_t parked;
+	int enabled;
+	long hits;
+	long misses;
+	long evictions;
+	double saved_usec;
+
+	ibvt_mr_cache() :
+		max_len(0),
+		parked(0),
+		enabled(getenv("IBV_TEST_MR_CACHE") ?
+			atoi(getenv("IBV_TEST_MR_CACHE")) : 0),
+		hits(0),
+		misses(0),
+		evictions(0),
+		saved_usec(0) {
+		sys_unmap_hook = unmapped;
+	}
+
+	~ibvt_mr_cache() {
+		std::map<struct ibv_mr *, entry *>::iterator it;
+		std::map<uintptr_t, mapping>::iterator mi;
+
+		sys_unmap_hook = NULL;
+		if (hits || misses)
+			VERBS_NOTICE("mr cache: %ld hits, %ld misses, %ld evicted, "
+				     "%.0f usec of ibv_reg_mr saved\n",
+				     hits, misses, evictions, saved_usec);
+		for (it = by_mr.begin(); it != by_mr.end(); it++) {
+			ibv_dereg_mr(it->first);
+			delete it->second;
+		}
+		for (mi = maps.begin(); mi != maps.end(); mi++)
+			munmap((void *)mi->first, mi->second.size);
+	}
+
+	static void unmapped(void *addr, size_t len);
+
+	static int size_class(size_t len) {
+		return len ? 63 - __builtin_clzl(len) : 0;
+	}
+
+	/* what registering len bytes on their own would have cost: misses
+	 * of the same power of two size, else the covering registration's
+	 * share of its own time */
+	double reg_cost(entry *e, size_t len) {
+		std::map<int, std::pair<double, long> >::iterator it;
+
+		it = cost.find(size_class(len));
+		if (it != cost.end())
+			return it->second.first / it->second.second;
+		return e->reg_usec * len / (e->end - e->start);
+	}
+
+	/* permissions may be widened, every other bit changes what the
+	 * registration is and has to match exactly */
+	static bool covers(long have, long want) {
+		const long perm = IBV_ACCESS_LOCAL_WRITE |
+				  IBV_ACCESS_REMOTE_WRITE |
+				  IBV_ACCESS_REMOTE_READ |
+				  IBV_ACCESS_REMOTE_ATOMIC;
+
+		return (have & ~perm) == (want & ~perm) &&
+		       (have & want & perm) == (want & perm);
+	}
+
+	entry *find(struct ibv_pd *pd, uintptr_t start, uintptr_t end,
+		    long access) {
+		std::multimap<uintptr_t, entry *>::iterator it;
+
+		it = tree.upper_bound(start);
+		while (it != tree.begin()) {
+			entry *e = (--it)->second;
+
+			if (start - e->start > max_len)
+				break;
+			if (e->pd == pd && e->end >= end &&
+			    covers(e->access, access))
+				return e;
+		}
+		return NULL;
+	}
+
+	struct ibv_mr *get(struct ibv_pd *pd, void *addr, size_t len,
+			   long access) {
+		uintptr_t start = (uintptr_t)addr;
+		struct ibv_mr *mr;
+		double t;
+		entry *e;
+
+		e = find(pd, start, start + len, access);
+		if (e) {
+			e->refs++;
+			hits++;
+			saved_usec += reg_cost(e, len);
+			return e->mr;
+		}
+		misses++;
+		t = sys_gettime();
+		mr = ibv_reg_mr(pd, addr, len, access);
+		if (!mr)
+			return NULL;
+		e = new entry();
+		e->pd = pd;
+		e->start = start;
+		e->end = start + len;
+		e->access = access;
+		e->mr = mr;
+		e->refs = 1;
+		e->stale = 0;
+		e->reg_usec = sys_gettime() - t;
+		cost[size_class(len)].first += e->reg_usec;
+		cost[size_class(len)].second++;
+		tree.insert(std::make_pair(start, e));
+		by_mr[mr] = e;
+		max_len = std::max(max_len, len);
+		return mr;
+	}
+
+	void release(entry *e) {
+		by_mr.erase(e->mr);
+		ibv_dereg_mr(e->mr);
+		delete e;
+	}
+
+	void put(struct ibv_mr *mr) {
+		entry *e = by_mr[mr];
+
+		if (!--e->refs && e->stale)
+			release(e);
+	}
+
+	void drop(std::multimap<uintptr_t, entry *>::iterator it) {
+		entry *e = it->second;
+
+		tree.erase(it);
+		evictions++;
+		e->stale = 1;
+		if (!e->refs)
+			release(e);
+	}
+
+	/* the PD goes away, nothing may keep it busy */
+	void flush(struct ibv_pd *pd) {
+		std::multimap<uintptr_t, entry *>::iterator it = tree.begin();
+
+		while (it != tree.end()) {
+			if (it->second->pd == pd)
+				drop(it++);
+			else
+				it++;
+		}
+	}
+
+	/* the range goes away, registrations over it must not be reused */
+	void evict(void *addr, size_t len) {
+		uintptr_t start = (uintptr_t)addr, end = start + len;
+		std::multimap<uintptr_t, entry *>::iterator it;
+
+		if (tree.empty())
+			return;
+		it = tree.lower_bound(start > max_len ? start - max_len : 0);
+		while (it != tree.end() && it->first < end) {
+			if (it->second->end <= start)
+				it++;
+			else
+				drop(it++);
+		}
+	}
+
+	/* an unmapped parked mapping is forgotten, and its rest with it */
+	void forget(void *addr, size_t len) {
+		uintptr_t start = (uintptr_t)addr, end = start + len;
+		std::map<uintptr_t, mapping>::iterator it;
+
+		it = maps.lower_bound(start > MRC_PARK_MAX ? start - MRC_PARK_MAX : 0);
+		while (it != maps.end() && it->first < end) {
+			void *at = (void *)it->first;
+			size_t size = it->second.size;
+
+			if (it->first + size <= start) {
+				it++;
+				continue;
+			}
+			maps.erase(it++);
+			parked -= size;
+			evict(at, size);
+			munmap(at, size);
+		}
+	}
+
+	int park(char *mem, size_t size, int pages, int fixed) {
+		mapping m = { size, pages, fixed };
+
+		if (parked + size > MRC_PARK_MAX)
+			return 0;
+		maps[(uintptr_t)mem] = m;
+		parked += size;
+		return 1;
+	}
+
+	char *unpark(intptr_t at, size_t size, int pages) {
+		std::map<uintptr_t, mapping>::iterator it;
+
+		if (at)
+			it = maps.find(at);
+		else
+			for (it = maps.begin(); it != maps.end(); it++)
+				if (!it->second.fixed &&
+				    it->second.size == size &&
+				    it->second.pages == pages)
+					break;
+		if (it == maps.end() || it->second.size != size ||
+		    it->second.pages != pages || it->second.fixed != !!at)
+			return NULL;
+		at = it->first;
+		maps.erase(it);
+		parked -= size;
+		return (char *)at;
+	}
+};
+
+inline ibvt_mr_cache &mr_cache() {
+	static ibvt_mr_cache c;
+	return c;
+}
+
+inline void ibvt_mr_cache::unmapped(void *addr, size_t len) {
+	mr_cache().evict(addr, len);
+	mr_cache().forget(addr, len);
+}
+
 struct ibvt_pd : public ibvt_obj {
 	struct ibv_pd *pd;
 	ibvt_ctx &ctx;
+	std::string pool_key;
 
 	ibvt_pd(ibvt_env &e, ibvt_ctx &c) : ibvt_obj(e), pd(NULL), ctx(c) {}
 
@@ -633,10 +1412,22 @@ struct ibvt_pd : public ibvt_obj {
 		if (pd)
 			return;
 		EXEC(ctx.init());
+		if (env.recycle && pool().enabled) {
+			pool_key = ibvt_pool::key(ctx.ctx, 0);
+			pd = (struct ibv_pd *)pool().get(ibvt_pool::POOL_PD, pool_key);
+			if (pd)
+				return;
+		}
 		SET(pd, ibv_alloc_pd(ctx.ctx));
 	}
 
 	virtual ~ibvt_pd() {
+		if (pd && pool_key.size()) {
+			pool().put(ibvt_pool::POOL_PD, pool_key, pd);
+			pd = NULL;
+		}
+		if (pd)
+			mr_cache().flush(pd);
 		FREE(ibv_dealloc_pd, pd);
 	}
 };
@@ -662,11 +1453,39 @@ struct ibvt_cq : public ibvt_obj {
 	struct ibv_cq *cq;
 	ibvt_ctx &ctx;
 
-	ibvt_cq(ibvt_env &e, ibvt_ctx &c) : ibvt_obj(e), cq(NULL), ctx(c) {}
+	std::string pool_key;
+
+	/* batched poll occupancy */
+	long batches;
+	long batch_cqes;
+	int batch_max;
+
+	/* HCA completion timestamps, on with IBV_TEST_CQ_TS: wc_ts holds
+	 * the raw ticks of the last poll in wc order */
+	int timestamps;
+	std::vector<uint64_t> wc_ts;
+
+	ibvt_cq(ibvt_env &e, ibvt_ctx &c) :
+		ibvt_obj(e),
+		cq(NULL),
+		ctx(c),
+		batches(0),
+		batch_cqes(0),
+		batch_max(0),
+		timestamps(0)
+	{
+		if (getenv("IBV_TEST_CQ_TS"))
+			timestamps = atoi(getenv("IBV_TEST_CQ_TS"));
+	}
 
 	virtual void init_attr(struct ibv_create_cq_attr_ex &attr, int &cqe) {
 		memset(&attr, 0, sizeof(attr));
 		cqe = 0x1000;
+#if !HAVE_INFINIBAND_VERBS_EXP_H
+		if (timestamps)
+			attr.wc_flags = IBV_WC_STANDARD_FLAGS |
+					IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
+#endif
 	}
 
 	virtual void init() {
@@ -676,10 +1495,28 @@ struct ibvt_cq : public ibvt_obj {
 			return;
 		EXEC(ctx.init());
 		init_attr(attr, cqe);
+		if (env.recycle && pool().enabled) {
+			pool_key = ibvt_pool::key(ctx.ctx, attr) +
+				   ibvt_pool::key(NULL, cqe);
+			cq = (struct ibv_cq *)pool().get(ibvt_pool::POOL_CQ, pool_key);
+			if (cq)
+				return;
+		}
 		SET(cq, ibv_create_cq_ex_(ctx.ctx, &attr, cqe, NULL));
 	}
 
 	virtual ~ibvt_cq() {
+		if (batches)
+			VERBS_INFO("cq %p: %ld cqes in %ld batches, avg %.2f max %d\n",
+				   this, batch_cqes, batches,
+				   (double)batch_cqes / batches, batch_max);
+		if (cq && pool_key.size()) {
+			struct ibv_wc wc[0x10];
+
+			while (ibv_poll_cq(cq, 0x10, wc) > 0);
+			pool().put(ibvt_pool::POOL_CQ, pool_key, cq);
+			cq = NULL;
+		}
 		FREE(ibv_destroy_cq, cq);
 	}
 
@@ -701,43 +1538,150 @@ struct ibvt_cq : public ibvt_obj {
 	}
 
 #if HAVE_INFINIBAND_VERBS_EXP_H
-	virtual void do_poll(struct ibvt_wc &wc) {
-		long result = 0, retries = POLL_RETRIES;
-		errno = 0;
-		while (!result && --retries) {
-			result = ibv_poll_cq(cq, 1, &wc.wc);
-			ASSERT_GE(result,0);
+	/* completion timestamps are read on the ibv_cq_ex path only */
+	uint64_t hw_clock() { return 0; }
+	double ts_ns(uint64_t ticks) { return 0; }
+
+	void check_ts() {
+		if (timestamps) {
+			VERBS_NOTICE("no HCA clock - skipping test\n");
+			env.skip = 1;
 		}
-		ASSERT_GT(retries,0) << "errno: " << errno;
+	}
+
+	virtual int try_poll(struct ibvt_wc &wc) {
+		return ibv_poll_cq(cq, 1, &wc.wc);
+	}
+
+	virtual int try_poll_batch(struct ibv_wc *wc, int n) {
+		return ibv_poll_cq(cq, n, wc);
 	}
 #else
 	struct ibv_cq_ex *cq2() {
 		return (struct ibv_cq_ex *)this->cq;
 	}
 
+	virtual void read_wc(struct ibv_wc &wc) {
+		wc.status = cq2()->status;
+		wc.wr_id = cq2()->wr_id;
+		wc.opcode = ibv_wc_read_opcode(cq2());
+		wc.wc_flags = ibv_wc_read_wc_flags(cq2());
+		wc.byte_len = ibv_wc_read_byte_len(cq2());
+		wc.slid = ibv_wc_read_slid(cq2());
+		wc.qp_num = ibv_wc_read_qp_num(cq2());
+		if (timestamps)
+			wc_ts.push_back(ibv_wc_read_completion_ts(cq2()));
+	}
+
+	/* current HCA clock, in the ticks of wc_ts */
+	uint64_t hw_clock() {
+		struct ibv_values_ex v = {};
+
+		v.comp_mask = IBV_VALUES_MASK_RAW_CLOCK;
+		if (ibv_query_rt_values_ex(ctx.ctx, &v))
+			return 0;
+		return v.raw_clock.tv_sec * 1000000000ULL + v.raw_clock.tv_nsec;
+	}
+
+	/* hca_core_clock is in kHz */
+	double ts_ns(uint64_t ticks) {
+		return ticks * 1e6 / ctx.dev_attr.hca_core_clock;
+	}
+
+	void check_ts() {
+		if (!timestamps)
+			return;
+		if (!ctx.dev_attr.hca_core_clock || !hw_clock()) {
+			VERBS_NOTICE("no HCA clock - skipping test\n");
+			env.skip = 1;
+		}
+	}
+
+	/* the poll is left open, ibvt_wc ends it */
+	virtual int try_poll(struct ibvt_wc &wc) {
+		struct ibv_poll_cq_attr attr = {};
+		int ret;
+
+		wc_ts.clear();
+		ret = ibv_start_poll(cq2(), &attr);
+		if (ret)
+			return ret == ENOENT ? 0 : -ret;
+		read_wc(wc.wc);
+		return 1;
+	}
+
+	virtual int try_poll_batch(struct ibv_wc *wc, int n) {
+		struct ibv_poll_cq_attr attr = {};
+		int ret, result = 0;
+
+		wc_ts.clear();
+		ret = ibv_start_poll(cq2(), &attr);
+		if (ret)
+			return ret == ENOENT ? 0 : -ret;
+		do {
+			read_wc(wc[result++]);
+		} while (result < n && !(ret = ibv_next_poll(cq2())));
+		ibv_end_poll(cq2());
+		if (result < n && ret != ENOENT)
+			return -ret;
+		return result;
+	}
+#endif
+
 	virtual void do_poll(struct ibvt_wc &wc) {
 		long result = 0, retries = POLL_RETRIES;
-		struct ibv_poll_cq_attr attr = {};
+		errno = 0;
+		while (!result && --retries) {
+			result = try_poll(wc);
+			ASSERT_GE(result,0);
+		}
+		ASSERT_GT(retries,0) << "errno: " << errno;
+	}
 
+	virtual void do_poll_batch(struct ibv_wc *wc, int n, int &result) {
+		long retries = POLL_RETRIES;
 		errno = 0;
-		while (--retries) {
-			result = ibv_start_poll(cq2(), &attr);
-			if (!result)
-				break;
-			ASSERT_EQ(ENOENT, result);
+		result = 0;
+		while (!result && --retries) {
+			result = try_poll_batch(wc, n);
+			ASSERT_GE(result,0);
 		}
 		ASSERT_GT(retries,0) << "errno: " << errno;
+	}
+
+	virtual void poll_batch(std::vector<struct ibv_wc> &wcs) {
+		int result = 0;
+
+		ASSERT_FALSE(wcs.empty());
+		EXEC(do_poll_batch(&wcs[0], wcs.size(), result));
+		wcs.resize(result);
 
-		wc.wc.status = cq2()->status;
-		wc.wc.wr_id = cq2()->wr_id;
-		wc.wc.opcode = ibv_wc_read_opcode(cq2());
-		wc.wc.wc_flags = ibv_wc_read_wc_flags(cq2());
-		wc.wc.byte_len = ibv_wc_read_byte_len(cq2());
-		wc.wc.slid = ibv_wc_read_slid(cq2());
-		wc.wc.qp_num = ibv_wc_read_qp_num(cq2());
+		batches++;
+		batch_cqes += result;
+		if (result > batch_max)
+			batch_max = result;
 
+		for (int i = 0; i < result; i++) {
+			VERBS_TRACE("poll status %s(%d) opcode %d len %d qp %x lid %x flags %lx\n",
+					ibv_wc_status_str(wcs[i].status),
+					wcs[i].status, wcs[i]._wc_opcode,
+					wcs[i].byte_len, wcs[i].qp_num,
+					wcs[i].slid, (uint64_t)wcs[i].wc_flags);
+			ASSERT_FALSE(wcs[i].status) << ibv_wc_status_str(wcs[i].status);
+		}
 	}
-#endif
+
+	virtual void poll(int n) {
+		std::vector<struct ibv_wc> wcs;
+
+		VERBS_TRACE("%d.%p polling %d...\n", __LINE__, this, n);
+		while (n > 0) {
+			wcs.resize(n);
+			EXEC(poll_batch(wcs));
+			n -= wcs.size();
+		}
+	}
+
 	virtual void poll_arrive(int n) {
 		struct ibv_wc wc[n];
 		long result = 0, retries = POLL_RETRIES;
@@ -763,12 +1707,24 @@ struct ibvt_cq_event : public ibvt_cq {
 	struct ibv_comp_channel *channel;
 	int num_cq_events;
 	int solicited_only;
+	/* completion moderation, off at 0/0: an event is raised once
+	 * moder_count CQEs are queued or moder_period usec have passed */
+	int moder_count;
+	int moder_period;
 
 	ibvt_cq_event(ibvt_env &e, ibvt_ctx &c) :
 		ibvt_cq(e, c),
 		channel(NULL),
 		num_cq_events(0),
-		solicited_only(0) {}
+		solicited_only(0),
+		moder_count(0),
+		moder_period(0)
+	{
+		if (getenv("IBV_TEST_CQ_COUNT"))
+			moder_count = atoi(getenv("IBV_TEST_CQ_COUNT"));
+		if (getenv("IBV_TEST_CQ_PERIOD"))
+			moder_period = atoi(getenv("IBV_TEST_CQ_PERIOD"));
+	}
 
 	virtual void init() {
 		struct ibv_create_cq_attr_ex attr;
@@ -779,6 +1735,8 @@ struct ibvt_cq_event : public ibvt_cq {
 		SET(channel, ibv_create_comp_channel(ctx.ctx));
 		init_attr(attr, cqe);
 		SET(cq, ibv_create_cq_ex_(ctx.ctx, &attr, cqe, channel));
+		if (moderated())
+			EXEC(moderate(moder_count, moder_period));
 	}
 
 	virtual ~ibvt_cq_event() {
@@ -788,12 +1746,44 @@ struct ibvt_cq_event : public ibvt_cq {
 		FREE(ibv_destroy_comp_channel, channel);
 	}
 
+	int moderated() {
+		return moder_count || moder_period;
+	}
+
+	virtual void moderate(int count, int period) {
+		int ret;
+
+		moder_count = count;
+		moder_period = period;
+#if HAVE_INFINIBAND_VERBS_EXP_H
+		struct ibv_exp_cq_attr attr = {};
+
+		attr.comp_mask = IBV_EXP_CQ_ATTR_MODERATION;
+		attr.moderation.cq_count = count;
+		attr.moderation.cq_period = period;
+		ret = ibv_exp_modify_cq(cq, &attr, IBV_EXP_CQ_MODERATION);
+#else
+		struct ibv_modify_cq_attr attr = {};
+
+		attr.attr_mask = IBV_CQ_ATTR_MODERATE;
+		attr.moderate.cq_count = count;
+		attr.moderate.cq_period = period;
+		ret = ibv_modify_cq(cq, &attr);
+#endif
+		if (ret == EOPNOTSUPP || ret == ENOSYS) {
+			VERBS_NOTICE("no CQ moderation - skipping test\n");
+			env.skip = 1;
+			return;
+		}
+		ASSERT_EQ(ret, 0) << "ibv_modify_cq";
+	}
+
 	virtual void arm() {
 		num_cq_events = 0;
 		DO(ibv_req_notify_cq(cq, solicited_only));
 	}
 
-	virtual void do_poll(struct ibvt_wc &wc) {
+	virtual void wait_event() {
 		struct ibv_cq *ev_cq;
 		void *ev_ctx;
 
@@ -801,8 +1791,185 @@ struct ibvt_cq_event : public ibvt_cq {
 		ASSERT_EQ(ev_cq, cq);
 		num_cq_events++;
 		DO(ibv_req_notify_cq(cq, solicited_only));
+	}
+
+	/* a moderated event covers several CQEs, drain before sleeping */
+	virtual void do_poll(struct ibvt_wc &wc) {
+		if (moderated()) {
+			int result = try_poll(wc);
+
+			ASSERT_GE(result, 0);
+			if (result)
+				return;
+		}
+		EXEC(wait_event());
 		EXEC(ibvt_cq::do_poll(wc));
 	}
+
+	virtual void do_poll_batch(struct ibv_wc *wc, int n, int &result) {
+		if (moderated()) {
+			result = try_poll_batch(wc, n);
+			ASSERT_GE(result, 0);
+			if (result)
+				return;
+		}
+		EXEC(wait_event());
+		EXEC(ibvt_cq::do_poll_batch(wc, n, result));
+	}
+};
+
+#define SPIN_BUDGET_US 50
+
+struct ibvt_cq_hybrid : public ibvt_cq_event {
+	double spin_budget;
+	int armed;
+	long spin_hits;
+	long race_hits;
+	long sleep_hits;
+	long stale_wakes;
+	double blocked;
+	double blocked_time;
+	double blocked_max;
+
+	ibvt_cq_hybrid(ibvt_env &e, ibvt_ctx &c) :
+		ibvt_cq_event(e, c),
+		spin_budget(SPIN_BUDGET_US),
+		armed(0),
+		spin_hits(0),
+		race_hits(0),
+		sleep_hits(0),
+		stale_wakes(0),
+		blocked(0),
+		blocked_time(0),
+		blocked_max(0)
+	{
+		if (getenv("IBV_TEST_SPIN_US"))
+			spin_budget = atof(getenv("IBV_TEST_SPIN_US"));
+	}
+
+	virtual ~ibvt_cq_hybrid() {
+		if (sleep_hits)
+			VERBS_NOTICE("cq %p: %ld spin %ld race %ld sleep %ld stale, "
+				     "blocked in ibv_get_cq_event avg %.1f max %.1f usec\n",
+				     this, spin_hits, race_hits, sleep_hits,
+				     stale_wakes, blocked_time / sleep_hits,
+				     blocked_max);
+		else if (spin_hits || race_hits)
+			VERBS_NOTICE("cq %p: %ld spin %ld race 0 sleep\n",
+				     this, spin_hits, race_hits);
+	}
+
+	/* the CQ is armed lazily, right before going to sleep */
+	virtual void arm() {}
+
+	/* consume one event, without block only if one is already queued */
+	virtual void get_event(int block) {
+		struct pollfd pfd = { channel->fd, POLLIN, 0 };
+		struct ibv_cq *ev_cq;
+		void *ev_ctx;
+		double start;
+
+		if (!block && ::poll(&pfd, 1, 0) <= 0)
+			return;
+		start = sys_gettime();
+		DO(ibv_get_cq_event(channel, &ev_cq, &ev_ctx));
+		blocked = sys_gettime() - start;
+		ASSERT_EQ(ev_cq, cq);
+		num_cq_events++;
+		armed = 0;
+	}
+
+	/* a CQE caught right after arming leaves its event behind, it is
+	 * consumed here so that the next sleep waits for a fresh one */
+	virtual void rearm() {
+		if (armed)
+			EXEC(get_event(0));
+		if (armed)
+			return;
+		DO(ibv_req_notify_cq(cq, solicited_only));
+		armed = 1;
+	}
+
+	void count_sleep() {
+		sleep_hits++;
+		blocked_time += blocked;
+		if (blocked > blocked_max)
+			blocked_max = blocked;
+	}
+
+	virtual void do_poll(struct ibvt_wc &wc) {
+		double start = sys_gettime();
+		int result = 0;
+
+		do {
+			result = ibvt_cq::try_poll(wc);
+			ASSERT_GE(result, 0);
+		} while (!result && sys_gettime() - start < spin_budget);
+		if (result) {
+			spin_hits++;
+			return;
+		}
+
+		for (;;) {
+			EXEC(rearm());
+			/* catch a completion which raced with arming */
+			result = ibvt_cq::try_poll(wc);
+			ASSERT_GE(result, 0);
+			if (result) {
+				race_hits++;
+				return;
+			}
+			EXEC(get_event(1));
+			result = ibvt_cq::try_poll(wc);
+			ASSERT_GE(result, 0);
+			if (result) {
+				count_sleep();
+				return;
+			}
+			stale_wakes++;
+		}
+	}
+
+	virtual void do_poll_batch(struct ibv_wc *wc, int n, int &result) {
+		double start = sys_gettime();
+
+		do {
+			result = ibvt_cq::try_poll_batch(wc, n);
+			ASSERT_GE(result, 0);
+		} while (!result && sys_gettime() - start < spin_budget);
+		if (result) {
+			spin_hits++;
+			return;
+		}
+
+		for (;;) {
+			EXEC(rearm());
+			result = ibvt_cq::try_poll_batch(wc, n);
+			ASSERT_GE(result, 0);
+			if (result) {
+				race_hits++;
+				return;
+			}
+			EXEC(get_event(1));
+			result = ibvt_cq::try_poll_batch(wc, n);
+			ASSERT_GE(result, 0);
+			if (result) {
+				count_sleep();
+				return;
+			}
+			stale_wakes++;
+		}
+	}
+};
+
+/* pages backing MR memory, IBV_TEST_PAGES=4k|thp|2m|1g sets the default;
+ * without it the kernel's THP policy decides */
+enum ibvt_pages {
+	IBVT_PAGES_ANY,
+	IBVT_PAGES_4K,
+	IBVT_PAGES_THP,
+	IBVT_PAGES_2M,
+	IBVT_PAGES_1G,
 };
 
 struct ibvt_abstract_mr : public ibvt_obj {
@@ -812,31 +1979,142 @@ struct ibvt_abstract_mr : public ibvt_obj {
 
 	char *mem;
 	size_t mem_size;
+	int pages;
 
 	ibvt_abstract_mr(ibvt_env &e, size_t s, intptr_t a) :
 		ibvt_obj(e),
 		size(s),
 		addr(a),
 		buff(NULL),
-		mem(NULL) {}
+		mem(NULL),
+		pages(pages_env()) {}
+
+	static int pages_env() {
+		const char *p = getenv("IBV_TEST_PAGES");
+
+		if (!p)
+			return IBVT_PAGES_ANY;
+		if (!strcasecmp(p, "4k"))
+			return IBVT_PAGES_4K;
+		if (!strcasecmp(p, "thp"))
+			return IBVT_PAGES_THP;
+		if (!strcasecmp(p, "2m"))
+			return IBVT_PAGES_2M;
+		if (!strcasecmp(p, "1g"))
+			return IBVT_PAGES_1G;
+		return IBVT_PAGES_ANY;
+	}
+
+	static size_t page_size(int pages) {
+		switch (pages) {
+		case IBVT_PAGES_2M:
+			return HUGE_2M;
+		case IBVT_PAGES_1G:
+			return HUGE_1G;
+		default:
+			return PAGE;
+		}
+	}
+
+	/* free pages in the hugetlbfs pool of that page size */
+	static long huge_count(size_t page, const char *name) {
+		char path[PATH_MAX], buf[32] = "";
+		int fd;
+
+		snprintf(path, sizeof(path),
+			 "/sys/kernel/mm/hugepages/hugepages-%zukB/%s",
+			 page >> 10, name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return 0;
+		if (read(fd, buf, sizeof(buf) - 1) < 0)
+			buf[0] = 0;
+		close(fd);
+		return atol(buf);
+	}
+
+	/* reserved pages are free but promised to existing mappings */
+	static long huge_free(size_t page) {
+		return std::max(0L, huge_count(page, "free_hugepages") -
+				    huge_count(page, "resv_hugepages"));
+	}
+
+	virtual size_t page_size() {
+		return page_size(pages);
+	}
 
 	virtual int mmap_flags() {
-		return MAP_PRIVATE|MAP_ANON;
+		switch (pages) {
+		case IBVT_PAGES_2M:
+			return MAP_PRIVATE|MAP_ANON|MAP_HUGETLB|(21 << MAP_HUGE_SHIFT);
+		case IBVT_PAGES_1G:
+			return MAP_PRIVATE|MAP_ANON|MAP_HUGETLB|(30 << MAP_HUGE_SHIFT);
+		default:
+			return MAP_PRIVATE|MAP_ANON;
+		}
 	}
 
 	virtual void init_mmap() {
 		int flags = mmap_flags();
+		size_t pg = page_size();
+		intptr_t at = addr & ~(pg - 1);
+		size_t slack = 0;
+		void *p;
+
 		if (addr) {
 			flags |= MAP_FIXED;
-			mem_size = PAGE_UPALIGN(size + (addr & PAGE_MASK));
+			mem_size = (size + (addr - at) + pg - 1) & ~(pg - 1);
+			/* MAP_FIXED would drop whatever was mapped there
+			 * without munmap() telling the mr cache */
+			munmap((void *)at, mem_size);
 		} else {
-			mem_size = size;
+			mem_size = (size + pg - 1) & ~(pg - 1);
+			/* room to start THP backed memory on a 2MB boundary */
+			if (pages == IBVT_PAGES_THP && mem_size >= HUGE_2M)
+				slack = HUGE_2M;
 		}
 
-		mem = (char*)mmap((void*)PAGE_ALIGN(addr),
-				  mem_size, PROT_READ|PROT_WRITE,
-				  flags, -1, 0);
-		ASSERT_NE(mem, MAP_FAILED);
+		/* a short hugetlbfs pool skips a test which is still being set
+		 * up rather than fails it, also when mmap() would succeed and
+		 * the first touch would SIGBUS */
+		if (flags & MAP_HUGETLB) {
+			long need = mem_size / pg, have = huge_free(pg);
+
+			if (have < need) {
+				ASSERT_FALSE(env.run) << have << " free "
+					<< (pg >> 10) << "kB huge pages, "
+					<< need << " needed";
+				VERBS_NOTICE("%3d.%p: %ld free %zukB huge pages, "
+					     "%ld needed - skipping test\n",
+					     __LINE__, this, have, pg >> 10, need);
+				env.skip = 1;
+				return;
+			}
+		}
+
+		p = mmap((void*)at, mem_size + slack, PROT_READ|PROT_WRITE,
+			 flags, -1, 0);
+		if (flags & MAP_HUGETLB) {
+			SET(mem, p == MAP_FAILED ? NULL : (char *)p);
+		} else {
+			mem = (char *)p;
+			ASSERT_NE(mem, MAP_FAILED);
+		}
+
+		if (slack) {
+			char *start = (char *)(((intptr_t)mem + slack - 1) & ~(slack - 1));
+
+			if (start != mem)
+				munmap(mem, start - mem);
+			munmap(start + mem_size, mem + slack - start);
+			mem = start;
+		}
+		/* best effort, "never" in sysfs still leaves 4K pages and
+		 * "always" would otherwise hand THPs to explicit 4K runs */
+		if (pages == IBVT_PAGES_THP)
+			madvise(mem, mem_size, MADV_HUGEPAGE);
+		else if (pages == IBVT_PAGES_4K)
+			madvise(mem, mem_size, MADV_NOHUGEPAGE);
 
 		buff = addr ? (char*)addr : mem;
 	}
@@ -849,17 +2127,41 @@ struct ibvt_abstract_mr : public ibvt_obj {
 	virtual uint32_t lkey() = 0;
 
 	virtual void fill() {
+		double start;
+
 		EXEC(init());
-		for (size_t i = 0; i < size; i++)
-			buff[i] = i & 0xff;
+		if (env.skip)
+			return;
+		start = sys_gettime();
+		sys_fill_pattern(buff, 0, size, 0);
+		VERBS_INFO("%3d.%p: fill\t%s%zu bytes %.2f GB/s (%s)\n", __LINE__,
+			   this, env.lvl_str, size,
+			   size / 1e3 / (sys_gettime() - start + 1e-3),
+			   sys_pattern_isa());
 	}
 
 	virtual void check(size_t skip = 0, size_t shift = 0, int repeat = 1, size_t length = 0) {
+		double start = sys_gettime();
+		size_t checked = 0;
+
 		if (!length)
 			length = size;
-		for (int n = 0; n < repeat; n++)
-			for (size_t i = skip + n * (length / repeat); i < length / repeat - shift; i++)
+		for (int n = 0; n < repeat; n++) {
+			size_t from = skip + n * (length / repeat);
+			size_t to = length / repeat - shift;
+
+			if (from >= to)
+				continue;
+			size_t bad = sys_check_pattern(buff, from, to, shift);
+			/* detailed per-byte report only past the first mismatch */
+			for (size_t i = bad; i < to; i++)
 				ASSERT_EQ((char)((i + shift) & 0xff), buff[i]) << "i=" << i;
+			checked += to - from;
+		}
+		VERBS_INFO("%3d.%p: verify\t%s%zu bytes %.2f GB/s (%s)\n", __LINE__,
+			   this, env.lvl_str, checked,
+			   checked / 1e3 / (sys_gettime() - start + 1e-3),
+			   sys_pattern_isa());
 		memset(buff, 0, size);
 	}
 
@@ -887,18 +2189,64 @@ struct ibvt_mr : public ibvt_abstract_mr {
 	ibvt_pd &pd;
 	long access_flags;
 	struct ibv_mr *mr;
+	std::string pool_key;
+	int cached;
 
 	ibvt_mr(ibvt_env &e, ibvt_pd &p, size_t s, intptr_t a = 0,
 		long af = IBV_ACCESS_LOCAL_WRITE |
 			  IBV_ACCESS_REMOTE_READ |
 			  IBV_ACCESS_REMOTE_WRITE) :
-		ibvt_abstract_mr(e, s, a), pd(p), access_flags(af), mr(NULL) {}
+		ibvt_abstract_mr(e, s, a), pd(p), access_flags(af), mr(NULL),
+		cached(0) {}
+
+	virtual void init_mmap() {
+		size_t pg = page_size();
+		intptr_t at = addr & ~(pg - 1);
+
+		if (mr_cache().enabled) {
+			mem_size = (size + (addr - at) + pg - 1) & ~(pg - 1);
+			mem = mr_cache().unpark(at, mem_size, pages);
+			if (mem) {
+				buff = addr ? (char *)addr : mem;
+				memset(buff, 0, size);
+				return;
+			}
+		}
+		EXEC(ibvt_abstract_mr::init_mmap());
+		/* before the first touch, so no page has to move */
+		if (mem && pd.ctx.mem_node >= 0)
+			DO(sys_mbind(mem, mem_size, pd.ctx.mem_node));
+	}
 
 	virtual void init() {
 		if (mr)
 			return;
 		EXEC(pd.init());
+		if (env.recycle && pool().enabled && !addr &&
+		    !(access_flags & IBV_ACCESS_ON_DEMAND)) {
+			ibvt_pool::mr_entry e;
+			int flags = mmap_flags();
+
+			pool_key = ibvt_pool::key(pd.pd, size) +
+				   ibvt_pool::key(NULL, access_flags) +
+				   ibvt_pool::key(NULL, flags) +
+				   ibvt_pool::key(NULL, pages);
+			if (pool().get_mr(pool_key, e)) {
+				mr = e.mr;
+				mem = buff = e.mem;
+				mem_size = e.mem_size;
+				memset(buff, 0, size);
+				return;
+			}
+		}
 		EXEC(init_mmap());
+		if (env.skip)
+			return;
+		if (mr_cache().enabled) {
+			SET(mr, mr_cache().get(pd.pd, buff, size, access_flags));
+			cached = 1;
+			return;
+		}
 		SET(mr, ibv_reg_mr(pd.pd, buff, size, access_flags));
 		VERBS_TRACE("\t\t\t\tibv_reg_mr(pd, %p, %zx, %lx) = %x\n", buff, size, access_flags, mr->lkey);
 	}
@@ -908,6 +2256,20 @@ struct ibvt_mr : public ibvt_abstract_mr {
 	}
 
 	virtual ~ibvt_mr() {
+		if (mr && pool_key.size()) {
+			ibvt_pool::mr_entry e = { mr, mem, mem_size };
+
+			pool().put_mr(pool_key, e);
+			mr = NULL;
+			mem = NULL;
+		}
+		if (mr && cached) {
+			mr_cache().put(mr);
+			mr = NULL;
+			/* still registered, a later ibvt_mr hits on it */
+			if (mem && mr_cache().park(mem, mem_size, pages, !!addr))
+				mem = NULL;
+		}
 		FREE(ibv_dereg_mr, mr);
 	}
 };
@@ -974,19 +2336,58 @@ struct ibvt_qp : public ibvt_obj {
 	struct ibv_qp *qp;
 	ibvt_pd &pd;
 	ibvt_cq &cq;
-
-		ibvt_qp(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) : ibvt_obj(e), qp(NULL), pd(p), cq(c) {}
+	std::string pool_key;
+
+	/* queue depths, lowered before init() when many QPs are needed */
+	uint32_t max_send_wr;
+	uint32_t max_recv_wr;
+	/* sends up to this size go inline, IBV_TEST_INLINE sets the default */
+	uint32_t max_inline_data;
+	/* selective signaling, off at 0: only every sig_period-th signaled
+	 * WR asks for a CQE, whose wr_id tells how many SQ slots it retires */
+	int sig_period;
+	int sig_pending;
+	long sq_used;
+	/* ring_db() copies single WQEs through the BlueFlame buffer */
+	int use_bf;
+
+	ibvt_qp(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) :
+		ibvt_obj(e),
+		qp(NULL),
+		pd(p),
+		cq(c),
+		max_send_wr(0x1000),
+		max_recv_wr(0x1000),
+		max_inline_data(0),
+		sig_period(0),
+		sig_pending(0),
+		sq_used(0),
+		use_bf(0)
+	{
+		if (getenv("IBV_TEST_INLINE"))
+			max_inline_data = strtoul(getenv("IBV_TEST_INLINE"), NULL, 0);
+	}
 
 	virtual ~ibvt_qp() {
+		if (qp && pool_key.size()) {
+			struct ibv_qp_attr attr = {};
+
+			attr.qp_state = IBV_QPS_RESET;
+			if (!ibv_modify_qp(qp, &attr, IBV_QP_STATE)) {
+				pool().put(ibvt_pool::POOL_QP, pool_key, qp);
+				qp = NULL;
+			}
+		}
 		FREE(ibv_destroy_qp, qp);
 	}
 
 	virtual void init_attr(struct ibv_qp_init_attr_ex &attr) {
 		memset(&attr, 0, sizeof(attr));
-		attr.cap.max_send_wr = 0x1000;
-		attr.cap.max_recv_wr = 0x1000;
+		attr.cap.max_send_wr = max_send_wr;
+		attr.cap.max_recv_wr = max_recv_wr;
 		attr.cap.max_send_sge = 1;
 		attr.cap.max_recv_sge = 1;
+		attr.cap.max_inline_data = max_inline_data;
 		attr.send_cq = cq.cq;
 		attr.recv_cq = cq.cq;
 		attr.pd = pd.pd;
@@ -998,7 +2399,15 @@ struct ibvt_qp : public ibvt_obj {
 		INIT(pd.init());
 		INIT(cq.init());
 		init_attr(attr);
-		SET(qp, ibv_create_qp_ex(pd.ctx.ctx, &attr));
+		/* a parked QP keeps its CQs busy, so both must be pooled too */
+		if (env.recycle && pool().enabled && !attr.srq &&
+		    cq.pool_key.size() && attr.send_cq == cq.cq &&
+		    attr.recv_cq == cq.cq) {
+			pool_key = ibvt_pool::key(pd.ctx.ctx, attr);
+			qp = (struct ibv_qp *)pool().get(ibvt_pool::POOL_QP, pool_key);
+		}
+		if (!qp)
+			SET(qp, ibv_create_qp_ex(pd.ctx.ctx, &attr));
 		INIT(init_dv());
 	}
 
@@ -1008,6 +2417,20 @@ struct ibvt_qp : public ibvt_obj {
 	void *uar_ptr;
 	int sqi;
 	int sq_len;
+	int bf_size;
+	int *bf_off;
+
+	/* QPs sharing a BF register must keep alternating its buffers */
+	static int *bf_offset(void *reg) {
+		static std::map<void *, int> off;
+		static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+		int *o;
+
+		pthread_mutex_lock(&lock);
+		o = &off[reg];
+		pthread_mutex_unlock(&lock);
+		return o;
+	}
 
 	virtual void init_dv() {
 		struct mlx5dv_qp dvqp = {};
@@ -1015,10 +2438,22 @@ struct ibvt_qp : public ibvt_obj {
 
 		dv.qp.in = qp;
 		dv.qp.out = &dvqp;
-		DO(mlx5dv_init_obj(&dv, MLX5DV_OBJ_QP));
+		/* only the loopback backend runs plain verbs without direct
+		 * WQE access, get_wqe() users elsewhere rely on sq */
+		if (!pd.ctx.loopback()) {
+			DO(mlx5dv_init_obj(&dv, MLX5DV_OBJ_QP));
+		} else if (mlx5dv_init_obj(&dv, MLX5DV_OBJ_QP)) {
+			VERBS_INFO("%3d.%p: no mlx5dv access to qp %x\n",
+				   __LINE__, this, qp->qp_num);
+			sq = NULL;
+			sq_len = 0;
+			return;
+		}
 		sq = (uint8_t *)dvqp.sq.buf;
 		qp_dbr = dvqp.dbrec;
 		uar_ptr = dvqp.bf.reg;
+		bf_size = dvqp.bf.size;
+		bf_off = bf_offset(uar_ptr);
 		sq_len = dvqp.sq.stride * dvqp.sq.wqe_cnt;
 		sqi = 0;
 	}
@@ -1029,19 +2464,34 @@ struct ibvt_qp : public ibvt_obj {
 		return wqe;
 	}
 
-	void ring_db(int i) {
-		void *ctrl = sq + (sqi * MLX5_SEND_WQE_BB) % sq_len;
+	/* i BBs were written, the last WQE starts at BB last of them */
+	void ring_db(int i, int last = 0) {
+		int off = ((sqi + last) * MLX5_SEND_WQE_BB) % sq_len;
+		void *ctrl = sq + off;
+		uint64_t *bf = (uint64_t *)((uint8_t *)uar_ptr + *bf_off);
 
 		//hexdump("WQE", ctrl, i * MLX5_SEND_WQE_BB);
 
 		sqi += i;
-		asm volatile("" ::: "memory");
+		DMA_WMB();
 
 		qp_dbr[MLX5_SND_DBR] = htobe32(sqi & 0xffff);
-		asm volatile("" ::: "memory");
-
-		*(uint64_t *)uar_ptr = *(uint64_t *)ctrl;
-		asm volatile("" ::: "memory");
+		DMA_WMB();
+
+		/* a lone WQE that fits the BF buffer and does not wrap goes
+		 * whole, so the HCA need not fetch it from host memory */
+		if (use_bf && !last && i * MLX5_SEND_WQE_BB <= bf_size &&
+		    off + i * MLX5_SEND_WQE_BB <= sq_len) {
+			for (int j = 0; j < i * MLX5_SEND_WQE_BB / 8; j++)
+				bf[j] = ((uint64_t *)ctrl)[j];
+		} else {
+			*bf = *(uint64_t *)ctrl;
+		}
+		/* the BF page is write-combining, do not leave the doorbell
+		 * in the WC buffer, mmio_flush_writes() in the provider */
+		WC_FLUSH();
+		/* the two BF buffers alternate, as in the provider */
+		*bf_off ^= bf_size;
 	}
 #else
 	virtual void init_dv() {}
@@ -1065,6 +2515,41 @@ struct ibvt_qp : public ibvt_obj {
 		DO(ibv_post_recv(qp, &wr, &bad_wr));
 	}
 
+	/* payload is copied into the WQE, the lkey is not looked at */
+	int inline_flag(const ibv_sge &sge, enum ibv_wr_opcode opcode) {
+		if (!max_inline_data || sge.length > max_inline_data ||
+		    opcode == IBV_WR_RDMA_READ)
+			return 0;
+		return IBV_SEND_INLINE;
+	}
+
+	/* the SQ must not fill up with WRs nobody will ever see complete */
+	int sig_flags(int flags, uint64_t &wr_id) {
+		if (!sig_period || !(flags & IBV_SEND_SIGNALED))
+			return flags;
+		sq_used++;
+		if (++sig_pending < sig_period && sq_used < (long)max_send_wr)
+			return flags & ~IBV_SEND_SIGNALED;
+		wr_id = sig_pending;
+		sig_pending = 0;
+		return flags;
+	}
+
+	/* the next WR is signaled, e.g. the last one of a run */
+	void sig_flush() {
+		if (sig_period)
+			sig_pending = sig_period - 1;
+	}
+
+	void reclaim(const struct ibv_wc &wc) {
+		if (sig_period)
+			sq_used -= wc.wr_id;
+	}
+
+	long sq_room() {
+		return max_send_wr - sq_used;
+	}
+
 	virtual void post_send(ibv_sge sge, enum ibv_wr_opcode opcode,
 			       int flags = IBV_SEND_SIGNALED) {
 		struct ibv_send_wr wr;
@@ -1076,7 +2561,8 @@ struct ibvt_qp : public ibvt_obj {
 		wr.sg_list = &sge;
 		wr.num_sge = 1;
 		wr._wr_opcode = opcode;
-		wr._wr_send_flags = flags;
+		wr._wr_send_flags = sig_flags(flags, wr.wr_id) |
+				    inline_flag(sge, opcode);
 		DO(ibv_post_send(qp, &wr, &bad_wr));
 	}
 
@@ -1084,14 +2570,15 @@ struct ibvt_qp : public ibvt_obj {
 		struct __rdma_wr {
 			ibv_send_wr wr;
 			ibv_sge sge;
-		} *wr = (__rdma_wr *)calloc(1, sizeof(*wr));
+		} *wr = (__rdma_wr *)env.alloc_wr(sizeof(*wr));
 
 		wr->sge = src_sge;
 		wr->wr.wr_id = 0;
 		wr->wr.sg_list = &wr->sge;
 		wr->wr.num_sge = 1;
 		wr->wr._wr_opcode = opcode;
-		wr->wr._wr_send_flags = flags;
+		wr->wr._wr_send_flags = sig_flags(flags, wr->wr.wr_id) |
+					inline_flag(src_sge, opcode);
 
 		wr->wr.wr.rdma.remote_addr = dst_sge.addr;
 		wr->wr.wr.rdma.rkey = dst_sge.lkey;
@@ -1204,6 +2691,185 @@ struct ibvt_qp_rc : public ibvt_qp {
 	virtual int has_rdma() { return 1; }
 };
 
+#if HAVE_DECL_MLX5DV_INIT_OBJ
+/* RC QP writing its WQEs straight into the SQ ring. rdma_wr() queues a
+ * SEND, RDMA_WRITE or RDMA_READ WQE and post_all_wr() rings one doorbell
+ * for all of them. Control segments are built once per opcode, only the
+ * WQE index is patched in. The provider does not see these posts, so
+ * completions carry no wr_id and the QP must not be mixed with
+ * ibv_post_send, inline data or selective signaling. */
+struct ibvt_qp_rc_dv : public ibvt_qp_rc {
+	enum { DV_SEND, DV_WRITE, DV_READ, DV_MAX };
+
+	struct mlx5_wqe_ctrl_seg ctrl_tmpl[2][DV_MAX];
+	int pending;
+
+	ibvt_qp_rc_dv(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) :
+		ibvt_qp_rc(e, p, c), pending(0) {}
+
+	virtual void init() {
+		static const uint8_t op[DV_MAX] = {
+			MLX5_OPCODE_SEND,
+			MLX5_OPCODE_RDMA_WRITE,
+			MLX5_OPCODE_RDMA_READ
+		};
+		/* in 16 byte units: ctrl + data, ctrl + raddr + data */
+		static const uint8_t ds[DV_MAX] = { 2, 3, 3 };
+
+		if (qp)
+			return;
+		INIT(ibvt_qp_rc::init());
+		if (!sq) {
+			VERBS_NOTICE("no direct WQE access - skipping test\n");
+			env.skip = 1;
+			return;
+		}
+		memset(ctrl_tmpl, 0, sizeof(ctrl_tmpl));
+		for (int i = 0; i < DV_MAX; i++) {
+			mlx5dv_set_ctrl_seg(&ctrl_tmpl[0][i], 0, op[i], 0,
+					    qp->qp_num, 0, ds[i], 0, 0);
+			mlx5dv_set_ctrl_seg(&ctrl_tmpl[1][i], 0, op[i], 0,
+					    qp->qp_num, MLX5_WQE_CTRL_CQ_UPDATE,
+					    ds[i], 0, 0);
+		}
+	}
+
+	/* Only WQEs not rung yet are bounded here. Rung ones stay owned by
+	 * the HCA until their CQE, so callers must keep posted but not
+	 * completed WQEs plus pending within the ring, as dv_test does by
+	 * polling every batch. */
+	void next_ctrl(int op, int flags, struct mlx5_wqe_ctrl_seg *&ctrl) {
+		int idx = sqi + pending;
+
+		/* past this point the WQE would overwrite an unposted one */
+		ASSERT_LT(pending, sq_len / MLX5_SEND_WQE_BB) << "send queue full";
+		pending++;
+		ctrl = (struct mlx5_wqe_ctrl_seg *)
+			(sq + (idx * MLX5_SEND_WQE_BB) % sq_len);
+		*ctrl = ctrl_tmpl[!!(flags & IBV_SEND_SIGNALED)][op];
+		ctrl->opmod_idx_opcode |= htobe32((idx & 0xffff) << 8);
+	}
+
+	virtual void rdma_wr(ibv_sge src_sge, ibv_sge dst_sge, enum ibv_wr_opcode opcode, int flags = IBV_SEND_SIGNALED) {
+		struct mlx5_wqe_ctrl_seg *ctrl;
+		struct mlx5_wqe_data_seg *dseg;
+
+		if (opcode == IBV_WR_SEND) {
+			EXEC(next_ctrl(DV_SEND, flags, ctrl));
+			dseg = (struct mlx5_wqe_data_seg *)(ctrl + 1);
+		} else if (opcode == IBV_WR_RDMA_WRITE || opcode == IBV_WR_RDMA_READ) {
+			struct mlx5_wqe_raddr_seg *raddr;
+
+			EXEC(next_ctrl(opcode == IBV_WR_RDMA_WRITE ?
+				       DV_WRITE : DV_READ, flags, ctrl));
+			raddr = (struct mlx5_wqe_raddr_seg *)(ctrl + 1);
+			raddr->raddr = htobe64(dst_sge.addr);
+			raddr->rkey = htobe32(dst_sge.lkey);
+			raddr->reserved = 0;
+			dseg = (struct mlx5_wqe_data_seg *)(raddr + 1);
+		} else {
+			FAIL() << "opcode " << opcode;
+		}
+		mlx5dv_set_data_seg(dseg, src_sge.length, src_sge.lkey,
+				    (intptr_t)src_sge.addr);
+	}
+
+	virtual void post_all_wr() {
+		if (pending) {
+			ring_db(pending, pending - 1);
+			pending = 0;
+		}
+		env.free_wr();
+	}
+
+	virtual void post_send(ibv_sge sge, enum ibv_wr_opcode opcode,
+			       int flags = IBV_SEND_SIGNALED) {
+		EXEC(rdma_wr(sge, sge, opcode, flags));
+		EXEC(post_all_wr());
+	}
+};
+
+/* ibvt_qp_rc_dv ringing single WQEs through BlueFlame */
+struct ibvt_qp_rc_bf : public ibvt_qp_rc_dv {
+	ibvt_qp_rc_bf(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) :
+		ibvt_qp_rc_dv(e, p, c) { use_bf = 1; }
+};
+#endif
+
+#if HAVE_DECL_IBV_WR_START
+/* RC QP posting through the ibv_wr_* API instead of ibv_send_wr lists.
+ * rdma_wr() opens a batch on first use and post_all_wr() completes it. */
+struct ibvt_qp_ex : public ibvt_qp_rc {
+	struct ibv_qp_ex *qpx;
+	int started;
+
+	ibvt_qp_ex(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) :
+		ibvt_qp_rc(e, p, c), qpx(NULL), started(0) {}
+
+	virtual void init_attr(struct ibv_qp_init_attr_ex &attr) {
+		ibvt_qp_rc::init_attr(attr);
+		attr.comp_mask |= IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+		attr.send_ops_flags = IBV_QP_EX_WITH_SEND |
+				      IBV_QP_EX_WITH_RDMA_WRITE |
+				      IBV_QP_EX_WITH_RDMA_READ;
+	}
+
+	virtual void init() {
+		if (qp)
+			return;
+		INIT(ibvt_qp_rc::init());
+		qpx = ibv_qp_to_qp_ex(qp);
+		if (!qpx) {
+			VERBS_NOTICE("no ibv_qp_ex - skipping test\n");
+			env.skip = 1;
+		}
+	}
+
+	virtual void rdma_wr(ibv_sge src_sge, ibv_sge dst_sge, enum ibv_wr_opcode opcode, int flags = IBV_SEND_SIGNALED) {
+		if (!started++)
+			ibv_wr_start(qpx);
+		qpx->wr_id = 0;
+		qpx->wr_flags = sig_flags(flags, qpx->wr_id) |
+				inline_flag(src_sge, opcode);
+		switch (opcode) {
+		case IBV_WR_SEND:
+			ibv_wr_send(qpx);
+			break;
+		case IBV_WR_RDMA_WRITE:
+			ibv_wr_rdma_write(qpx, dst_sge.lkey, dst_sge.addr);
+			break;
+		case IBV_WR_RDMA_READ:
+			ibv_wr_rdma_read(qpx, dst_sge.lkey, dst_sge.addr);
+			break;
+		default:
+			ibv_wr_abort(qpx);
+			started = 0;
+			FAIL() << "opcode " << opcode;
+		}
+		if (qpx->wr_flags & IBV_SEND_INLINE)
+			ibv_wr_set_inline_data(qpx, (void *)(uintptr_t)src_sge.addr,
+					       src_sge.length);
+		else
+			ibv_wr_set_sge(qpx, src_sge.lkey, src_sge.addr,
+				       src_sge.length);
+	}
+
+	virtual void post_all_wr() {
+		if (started) {
+			started = 0;
+			DO(ibv_wr_complete(qpx));
+		}
+		env.free_wr();
+	}
+
+	virtual void post_send(ibv_sge sge, enum ibv_wr_opcode opcode,
+			       int flags = IBV_SEND_SIGNALED) {
+		EXEC(rdma_wr(sge, sge, opcode, flags));
+		EXEC(post_all_wr());
+	}
+};
+#endif
+
 struct ibvt_qp_ud : public ibvt_qp_rc {
 	struct ibv_ah *ah;
 
@@ -1233,7 +2899,8 @@ struct ibvt_qp_ud : public ibvt_qp_rc {
 		wr.sg_list = &sge_ud;
 		wr.num_sge = 1;
 		wr._wr_opcode = opcode;
-		wr._wr_send_flags = flags;
+		wr._wr_send_flags = sig_flags(flags, wr.wr_id) |
+				    inline_flag(sge_ud, opcode);
 
 		wr.wr.ud.ah = ah;
 		wr.wr.ud.remote_qpn = remote->qp->qp_num;
@@ -1733,4 +3400,11 @@ struct ibvt_mw : public ibvt_mr {
 	}
 };
 
+/* a QP and CQ fixture pair for TYPED_TEST_CASE lists */
+template <typename T1, typename T2>
+struct types_2 {
+	typedef T1 QP;
+	typedef T2 CQ;
+};
+
 #endif
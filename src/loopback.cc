@@ -0,0 +1,1394 @@
+/**
+ * Copyright (C) 2015      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * In-process loopback verbs backend, enabled by IBV_TEST_LOOPBACK=<devices>.
+ *
+ * The non-inline libibverbs entry points used by the framework are
+ * interposed here and fall through to the real library (RTLD_NEXT) for
+ * any object which does not belong to a loopback device. Loopback
+ * contexts fill ibv_context_ops and verbs_context, so the inline data
+ * path (post/poll/cq_ex) lands here as well. Every WR is executed
+ * synchronously at post time with real data movement between the
+ * registered buffers; RC sends wait for a receive WQE, UD sends without
+ * one are dropped.
+ */
+#include "common.h"
+#include <poll.h>
+#include <infiniband/verbs.h>
+#if HAVE_INFINIBAND_MLX5DV_H
+extern "C" {
+#include <infiniband/mlx5dv.h>
+}
+#endif
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+
+#undef ibv_get_device_list
+#undef ibv_reg_mr
+
+#define LB_MAX_DEVS 8
+#define LB_GRH 40
+
+struct lb_recv {
+	uint64_t wr_id;
+	std::vector<struct ibv_sge> sge;
+};
+
+struct lb_qp;
+
+struct lb_msg {
+	struct lb_qp *src;
+	uint64_t wr_id;
+	int signaled;
+	enum ibv_wr_opcode opcode;
+	std::vector<char> data;
+	uint32_t len;
+	uint32_t imm;
+};
+
+struct lb_cq {
+	struct ibv_cq_ex cq;
+	std::deque<struct ibv_wc> wc;
+	struct ibv_wc cur;
+	/* TSC at completion, the loopback HCA clock */
+	std::deque<uint64_t> ts;
+	uint64_t cur_ts;
+	int armed;
+	/* moderation, since is when the first held back CQE came in */
+	uint16_t moder_count;
+	uint16_t moder_period;
+	double moder_since;
+};
+
+struct lb_srq {
+	struct ibv_srq srq;
+	std::deque<lb_recv> rq;
+};
+
+/* a WR built through the ibv_wr_* API, run at ibv_wr_complete() */
+struct lb_wr {
+	struct ibv_send_wr wr;
+	struct ibv_sge sge;
+	std::vector<char> inl;
+};
+
+/* qp_base is only a copy, the ops find their QP through qp */
+struct lb_qpx {
+	struct ibv_qp_ex qpx;
+	struct lb_qp *qp;
+};
+
+struct lb_qp {
+	struct ibv_qp qp;
+	uint32_t dest_qpn;
+	uint32_t qkey;
+	int access;
+	int sq_sig_all;
+	struct ibv_qp_cap cap;
+	std::deque<lb_recv> rq;
+	std::deque<lb_msg> pending;
+#if HAVE_DECL_IBV_WR_START
+	struct lb_qpx x;
+	uint64_t send_ops_flags;
+	std::vector<lb_wr> wr;
+#endif
+};
+
+struct lb_mr {
+	struct ibv_mr mr;
+	int access;
+};
+
+struct lb_ah {
+	struct ibv_ah ah;
+	struct ibv_ah_attr attr;
+};
+
+struct lb_channel {
+	struct ibv_comp_channel channel;
+	int wfd;
+};
+
+static struct lb_state {
+	int devices;
+	struct ibv_device dev[LB_MAX_DEVS];
+	pthread_mutex_t lock;
+	uint32_t next_qpn;
+	uint32_t next_key;
+	std::map<uint32_t, lb_qp *> qps;
+	std::map<uint32_t, lb_mr *> mrs;
+	std::vector<lb_cq *> moderated;
+
+	long post_send;
+	long post_recv;
+	long polls;
+	long completions;
+	long errors;
+	long bytes;
+	long reg_mr;
+	long modify_qp;
+
+	lb_state() :
+		devices(0),
+		next_qpn(0x100),
+		next_key(0x1000),
+		post_send(0),
+		post_recv(0),
+		polls(0),
+		completions(0),
+		errors(0),
+		bytes(0),
+		reg_mr(0),
+		modify_qp(0)
+	{
+		char *env = getenv("IBV_TEST_LOOPBACK");
+
+		pthread_mutex_init(&lock, NULL);
+		memset(dev, 0, sizeof(dev));
+		if (env)
+			devices = std::min(std::max(atoi(env), 1), LB_MAX_DEVS);
+		for (int i = 0; i < devices; i++) {
+			dev[i].node_type = IBV_NODE_CA;
+			dev[i].transport_type = IBV_TRANSPORT_IB;
+			snprintf(dev[i].name, sizeof(dev[i].name), "loopback%d", i);
+			snprintf(dev[i].dev_name, sizeof(dev[i].dev_name), "uverbs%d", i);
+		}
+	}
+
+	~lb_state() {
+		if (devices)
+			VERBS_NOTICE("loopback: %ld send WRs, %ld recv WRs, %ld polls, "
+				     "%ld completions (%ld errors), %ld bytes, "
+				     "%ld reg_mr, %ld modify_qp\n",
+				     post_send, post_recv, polls, completions,
+				     errors, bytes, reg_mr, modify_qp);
+	}
+} lb;
+
+struct lb_guard {
+	lb_guard() { pthread_mutex_lock(&lb.lock); }
+	~lb_guard() { pthread_mutex_unlock(&lb.lock); }
+};
+
+static bool lb_dev(struct ibv_device *dev)
+{
+	return dev >= lb.dev && dev < lb.dev + lb.devices;
+}
+
+static bool lb_ctx(struct ibv_context *ctx)
+{
+	return ctx && lb_dev(ctx->device);
+}
+
+static struct lb_qp *lb_qp_of(struct ibv_qp *qp) { return (struct lb_qp *)qp; }
+static struct lb_cq *lb_cq_of(struct ibv_cq *cq) { return (struct lb_cq *)cq; }
+static struct lb_cq *lb_cq_of(struct ibv_cq_ex *cq) { return (struct lb_cq *)cq; }
+static struct lb_srq *lb_srq_of(struct ibv_srq *srq) { return (struct lb_srq *)srq; }
+
+/* completions */
+
+static void lb_unmoderate(struct lb_cq *cq)
+{
+	if (!cq->moder_since)
+		return;
+	cq->moder_since = 0;
+	lb.moderated.erase(std::find(lb.moderated.begin(),
+				     lb.moderated.end(), cq));
+}
+
+static void lb_event(struct lb_cq *cq)
+{
+	struct lb_channel *ch = (struct lb_channel *)cq->cq.channel;
+
+	cq->armed = 0;
+	lb_unmoderate(cq);
+	if (ch && write(ch->wfd, &cq, sizeof(cq)) != sizeof(cq))
+		VERBS_ERR("loopback: lost cq event\n");
+}
+
+/* the event is held back until cq_count CQEs are queued or cq_period
+ * usec passed since the first one, ibv_get_cq_event() sees the latter */
+static bool lb_defer(struct lb_cq *cq)
+{
+	if (!cq->moder_count && !cq->moder_period)
+		return false;
+	if (cq->moder_count && cq->wc.size() >= cq->moder_count)
+		return false;
+	if (!cq->moder_since) {
+		cq->moder_since = sys_gettime();
+		lb.moderated.push_back(cq);
+	}
+	return !cq->moder_period ||
+	       sys_gettime() - cq->moder_since < cq->moder_period;
+}
+
+static void lb_complete(struct ibv_cq *ibcq, const struct ibv_wc &wc)
+{
+	struct lb_cq *cq = lb_cq_of(ibcq);
+
+	cq->wc.push_back(wc);
+	cq->ts.push_back(sys_rdtsc());
+	lb.completions++;
+	lb.errors += wc.status != IBV_WC_SUCCESS;
+	if (cq->armed && !lb_defer(cq))
+		lb_event(cq);
+}
+
+static void lb_send_wc(struct lb_qp *qp, uint64_t wr_id, int signaled,
+		       enum ibv_wc_opcode opcode, uint32_t len,
+		       enum ibv_wc_status status)
+{
+	struct ibv_wc wc = {};
+
+	if (!signaled && !qp->sq_sig_all && status == IBV_WC_SUCCESS)
+		return;
+	wc.wr_id = wr_id;
+	wc.status = status;
+	wc.opcode = opcode;
+	wc.byte_len = len;
+	wc.qp_num = qp->qp.qp_num;
+	if (status != IBV_WC_SUCCESS)
+		qp->qp.state = IBV_QPS_ERR;
+	lb_complete(qp->qp.send_cq, wc);
+}
+
+/* memory keys */
+
+static char *lb_key(uint32_t key, struct ibv_pd *pd, uint64_t addr,
+		    uint64_t len, int access)
+{
+	std::map<uint32_t, lb_mr *>::iterator i = lb.mrs.find(key);
+	struct lb_mr *mr;
+
+	if (i == lb.mrs.end())
+		return NULL;
+	mr = i->second;
+	if (mr->mr.pd != pd || (mr->access & access) != access)
+		return NULL;
+	if (addr < (uintptr_t)mr->mr.addr ||
+	    addr + len > (uintptr_t)mr->mr.addr + mr->mr.length)
+		return NULL;
+	return (char *)(uintptr_t)addr;
+}
+
+static bool lb_gather(struct lb_qp *qp, struct ibv_send_wr *wr,
+		      std::vector<char> &data)
+{
+	for (int i = 0; i < wr->num_sge; i++) {
+		struct ibv_sge &s = wr->sg_list[i];
+		char *p = (wr->send_flags & IBV_SEND_INLINE) ?
+			  (char *)(uintptr_t)s.addr :
+			  lb_key(s.lkey, qp->qp.pd, s.addr, s.length, 0);
+
+		if (!p)
+			return false;
+		data.insert(data.end(), p, p + s.length);
+	}
+	return true;
+}
+
+static enum ibv_wc_status lb_scatter(struct ibv_pd *pd, struct ibv_sge *sge,
+				     int num_sge, const char *data, size_t len)
+{
+	for (int i = 0; i < num_sge && len; i++) {
+		size_t n = std::min<size_t>(len, sge[i].length);
+		char *p = lb_key(sge[i].lkey, pd, sge[i].addr, n,
+				 IBV_ACCESS_LOCAL_WRITE);
+
+		if (!p)
+			return IBV_WC_LOC_PROT_ERR;
+		memcpy(p, data, n);
+		data += n;
+		len -= n;
+	}
+	return len ? IBV_WC_LOC_LEN_ERR : IBV_WC_SUCCESS;
+}
+
+/* receive side */
+
+static std::deque<lb_recv> &lb_rq(struct lb_qp *qp)
+{
+	return qp->qp.srq ? lb_srq_of(qp->qp.srq)->rq : qp->rq;
+}
+
+static bool lb_deliver(struct lb_qp *dst, lb_msg &m)
+{
+	std::deque<lb_recv> &rq = lb_rq(dst);
+	struct ibv_wc wc = {};
+	std::vector<char> data;
+
+	if (rq.empty())
+		return false;
+	lb_recv r = rq.front();
+	rq.pop_front();
+
+	if (dst->qp.qp_type == IBV_QPT_UD)
+		data.resize(LB_GRH);
+	data.insert(data.end(), m.data.begin(), m.data.end());
+
+	wc.wr_id = r.wr_id;
+	wc.qp_num = dst->qp.qp_num;
+	wc.src_qp = m.src->qp.qp_num;
+	wc.slid = 1;
+	wc.byte_len = m.opcode == IBV_WR_RDMA_WRITE_WITH_IMM ? m.len : data.size();
+	wc.opcode = m.opcode == IBV_WR_RDMA_WRITE_WITH_IMM ?
+		    IBV_WC_RECV_RDMA_WITH_IMM : IBV_WC_RECV;
+	if (m.opcode != IBV_WR_SEND) {
+		wc.wc_flags = IBV_WC_WITH_IMM;
+		wc.imm_data = m.imm;
+	}
+	wc.status = lb_scatter(dst->qp.pd, r.sge.data(), r.sge.size(),
+			       data.data(), data.size());
+	lb.bytes += m.data.size();
+	lb_complete(dst->qp.recv_cq, wc);
+
+	lb_send_wc(m.src, m.wr_id, m.signaled,
+		   m.opcode == IBV_WR_RDMA_WRITE_WITH_IMM ? IBV_WC_RDMA_WRITE : IBV_WC_SEND,
+		   m.len, wc.status == IBV_WC_SUCCESS ? IBV_WC_SUCCESS : IBV_WC_REM_INV_REQ_ERR);
+	return true;
+}
+
+static void lb_drain(struct lb_qp *dst)
+{
+	while (dst->pending.size() && lb_deliver(dst, dst->pending.front()))
+		dst->pending.pop_front();
+}
+
+static void lb_flush(struct lb_qp *qp)
+{
+	std::deque<lb_recv> &rq = qp->rq;
+
+	while (rq.size()) {
+		struct ibv_wc wc = {};
+
+		wc.wr_id = rq.front().wr_id;
+		wc.status = IBV_WC_WR_FLUSH_ERR;
+		wc.qp_num = qp->qp.qp_num;
+		rq.pop_front();
+		lb_complete(qp->qp.recv_cq, wc);
+	}
+	qp->pending.clear();
+}
+
+/* send side */
+
+static struct lb_qp *lb_peer(uint32_t qpn)
+{
+	std::map<uint32_t, lb_qp *>::iterator i = lb.qps.find(qpn);
+
+	return i == lb.qps.end() ? NULL : i->second;
+}
+
+static int lb_exec(struct lb_qp *qp, struct ibv_send_wr *wr)
+{
+	int signaled = wr->send_flags & IBV_SEND_SIGNALED;
+	struct lb_qp *dst;
+	lb_msg m;
+
+	if (qp->qp.state != IBV_QPS_RTS)
+		return EINVAL;
+	if (wr->send_flags & IBV_SEND_INLINE) {
+		uint32_t len = 0;
+
+		for (int i = 0; i < wr->num_sge; i++)
+			len += wr->sg_list[i].length;
+		if (len > qp->cap.max_inline_data)
+			return EINVAL;
+	}
+
+	dst = lb_peer(qp->qp.qp_type == IBV_QPT_UD ? wr->wr.ud.remote_qpn : qp->dest_qpn);
+	if (!dst || dst->qp.state < IBV_QPS_RTR || dst->qp.state > IBV_QPS_SQD) {
+		enum ibv_wc_status st = qp->qp.qp_type == IBV_QPT_UD ?
+					IBV_WC_SUCCESS : IBV_WC_RETRY_EXC_ERR;
+
+		lb_send_wc(qp, wr->wr_id, signaled, IBV_WC_SEND, 0, st);
+		return 0;
+	}
+
+	m.src = qp;
+	m.wr_id = wr->wr_id;
+	m.signaled = signaled;
+	m.opcode = wr->opcode;
+	m.imm = wr->imm_data;
+
+	switch (wr->opcode) {
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		if (qp->qp.qp_type == IBV_QPT_UD && wr->wr.ud.remote_qkey != dst->qkey)
+			return 0;
+		if (!lb_gather(qp, wr, m.data)) {
+			lb_send_wc(qp, wr->wr_id, 1, IBV_WC_SEND, 0, IBV_WC_LOC_PROT_ERR);
+			return 0;
+		}
+		m.len = m.data.size();
+		if (!lb_deliver(dst, m) && qp->qp.qp_type != IBV_QPT_UD)
+			dst->pending.push_back(m);
+		else if (qp->qp.qp_type == IBV_QPT_UD && lb_rq(dst).empty())
+			lb_send_wc(qp, wr->wr_id, signaled, IBV_WC_SEND, m.len, IBV_WC_SUCCESS);
+		return 0;
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM: {
+		char *p;
+
+		if (qp->qp.qp_type != IBV_QPT_RC || !lb_gather(qp, wr, m.data)) {
+			lb_send_wc(qp, wr->wr_id, 1, IBV_WC_RDMA_WRITE, 0, IBV_WC_LOC_PROT_ERR);
+			return 0;
+		}
+		m.len = m.data.size();
+		p = lb_key(wr->wr.rdma.rkey, dst->qp.pd, wr->wr.rdma.remote_addr,
+			   m.len, IBV_ACCESS_REMOTE_WRITE);
+		if (!p || !(dst->access & IBV_ACCESS_REMOTE_WRITE)) {
+			lb_send_wc(qp, wr->wr_id, 1, IBV_WC_RDMA_WRITE, 0, IBV_WC_REM_ACCESS_ERR);
+			return 0;
+		}
+		memcpy(p, m.data.data(), m.len);
+		lb.bytes += m.len;
+		if (wr->opcode == IBV_WR_RDMA_WRITE) {
+			lb_send_wc(qp, wr->wr_id, signaled, IBV_WC_RDMA_WRITE, m.len, IBV_WC_SUCCESS);
+			return 0;
+		}
+		m.data.clear();
+		if (!lb_deliver(dst, m))
+			dst->pending.push_back(m);
+		return 0;
+	}
+	case IBV_WR_RDMA_READ: {
+		uint32_t len = 0;
+		char *p;
+
+		for (int i = 0; i < wr->num_sge; i++)
+			len += wr->sg_list[i].length;
+		p = lb_key(wr->wr.rdma.rkey, dst->qp.pd, wr->wr.rdma.remote_addr,
+			   len, IBV_ACCESS_REMOTE_READ);
+		if (qp->qp.qp_type != IBV_QPT_RC || !p ||
+		    !(dst->access & IBV_ACCESS_REMOTE_READ)) {
+			lb_send_wc(qp, wr->wr_id, 1, IBV_WC_RDMA_READ, 0, IBV_WC_REM_ACCESS_ERR);
+			return 0;
+		}
+		lb.bytes += len;
+		lb_send_wc(qp, wr->wr_id, signaled, IBV_WC_RDMA_READ, len,
+			   lb_scatter(qp->qp.pd, wr->sg_list, wr->num_sge, p, len));
+		return 0;
+	}
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+	case IBV_WR_ATOMIC_FETCH_AND_ADD: {
+		enum ibv_wc_opcode op = wr->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ?
+					IBV_WC_FETCH_ADD : IBV_WC_COMP_SWAP;
+		uint64_t *p, old;
+
+		p = (uint64_t *)lb_key(wr->wr.atomic.rkey, dst->qp.pd,
+				       wr->wr.atomic.remote_addr, 8,
+				       IBV_ACCESS_REMOTE_ATOMIC);
+		if (qp->qp.qp_type != IBV_QPT_RC || !p || wr->num_sge != 1 ||
+		    !(dst->access & IBV_ACCESS_REMOTE_ATOMIC)) {
+			lb_send_wc(qp, wr->wr_id, 1, op, 0, IBV_WC_REM_ACCESS_ERR);
+			return 0;
+		}
+		old = *p;
+		if (op == IBV_WC_FETCH_ADD)
+			*p += wr->wr.atomic.compare_add;
+		else if (old == wr->wr.atomic.compare_add)
+			*p = wr->wr.atomic.swap;
+		lb_send_wc(qp, wr->wr_id, signaled, op, 8,
+			   lb_scatter(qp->qp.pd, wr->sg_list, 1, (char *)&old, 8));
+		return 0;
+	}
+	default:
+		return EINVAL;
+	}
+}
+
+/* context ops */
+
+static int lb_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			struct ibv_send_wr **bad_wr)
+{
+	lb_guard g;
+
+	for (; wr; wr = wr->next) {
+		int ret = lb_exec(lb_qp_of(ibqp), wr);
+
+		if (ret) {
+			*bad_wr = wr;
+			return ret;
+		}
+		lb.post_send++;
+	}
+	return 0;
+}
+
+#if HAVE_DECL_IBV_WR_START
+/* ibv_qp_ex ops: WRs are collected and posted as one list */
+
+static struct lb_qp *lb_qp_of(struct ibv_qp_ex *qpx)
+{
+	return ((struct lb_qpx *)qpx)->qp;
+}
+
+static void lb_wr_start(struct ibv_qp_ex *qpx)
+{
+	lb_qp_of(qpx)->wr.clear();
+}
+
+static void lb_wr_add(struct ibv_qp_ex *qpx, enum ibv_wr_opcode opcode,
+		      uint32_t rkey, uint64_t raddr)
+{
+	struct lb_qp *qp = lb_qp_of(qpx);
+	lb_wr w;
+
+	memset(&w.wr, 0, sizeof(w.wr));
+	memset(&w.sge, 0, sizeof(w.sge));
+	w.wr.wr_id = qpx->wr_id;
+	w.wr.opcode = opcode;
+	w.wr.send_flags = qpx->wr_flags;
+	w.wr.wr.rdma.rkey = rkey;
+	w.wr.wr.rdma.remote_addr = raddr;
+	qp->wr.push_back(w);
+}
+
+static void lb_wr_send(struct ibv_qp_ex *qpx)
+{
+	lb_wr_add(qpx, IBV_WR_SEND, 0, 0);
+}
+
+static void lb_wr_rdma_write(struct ibv_qp_ex *qpx, uint32_t rkey,
+			     uint64_t remote_addr)
+{
+	lb_wr_add(qpx, IBV_WR_RDMA_WRITE, rkey, remote_addr);
+}
+
+static void lb_wr_rdma_read(struct ibv_qp_ex *qpx, uint32_t rkey,
+			    uint64_t remote_addr)
+{
+	lb_wr_add(qpx, IBV_WR_RDMA_READ, rkey, remote_addr);
+}
+
+static void lb_wr_set_sge(struct ibv_qp_ex *qpx, uint32_t lkey,
+			  uint64_t addr, uint32_t length)
+{
+	lb_wr &w = lb_qp_of(qpx)->wr.back();
+
+	w.sge.lkey = lkey;
+	w.sge.addr = addr;
+	w.sge.length = length;
+	w.wr.num_sge = 1;
+}
+
+/* the payload is copied now, the caller may reuse the buffer */
+static void lb_wr_set_inline_data(struct ibv_qp_ex *qpx, void *addr,
+				  size_t length)
+{
+	lb_wr &w = lb_qp_of(qpx)->wr.back();
+
+	w.inl.assign((char *)addr, (char *)addr + length);
+	w.sge.length = length;
+	w.wr.num_sge = 1;
+	w.wr.send_flags |= IBV_SEND_INLINE;
+}
+
+static int lb_wr_complete(struct ibv_qp_ex *qpx)
+{
+	struct lb_qp *qp = lb_qp_of(qpx);
+	lb_guard g;
+	int ret = 0;
+
+	for (size_t i = 0; i < qp->wr.size() && !ret; i++) {
+		lb_wr &w = qp->wr[i];
+
+		if (w.wr.send_flags & IBV_SEND_INLINE)
+			w.sge.addr = (uintptr_t)w.inl.data();
+		w.wr.sg_list = &w.sge;
+		ret = lb_exec(qp, &w.wr);
+		if (!ret)
+			lb.post_send++;
+	}
+	qp->wr.clear();
+	return ret;
+}
+
+static void lb_wr_abort(struct ibv_qp_ex *qpx)
+{
+	lb_qp_of(qpx)->wr.clear();
+}
+#endif
+
+static void lb_push_recv(std::deque<lb_recv> &rq, struct ibv_recv_wr *wr)
+{
+	lb_recv r;
+
+	r.wr_id = wr->wr_id;
+	r.sge.assign(wr->sg_list, wr->sg_list + wr->num_sge);
+	rq.push_back(r);
+	lb.post_recv++;
+}
+
+static int lb_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
+			struct ibv_recv_wr **bad_wr)
+{
+	struct lb_qp *qp = lb_qp_of(ibqp);
+	lb_guard g;
+
+	if (qp->qp.srq || qp->qp.state == IBV_QPS_RESET) {
+		*bad_wr = wr;
+		return EINVAL;
+	}
+	for (; wr; wr = wr->next)
+		lb_push_recv(qp->rq, wr);
+	lb_drain(qp);
+	return 0;
+}
+
+static int lb_post_srq_recv(struct ibv_srq *srq, struct ibv_recv_wr *wr,
+			    struct ibv_recv_wr **bad_wr)
+{
+	lb_guard g;
+
+	for (; wr; wr = wr->next)
+		lb_push_recv(lb_srq_of(srq)->rq, wr);
+	for (std::map<uint32_t, lb_qp *>::iterator i = lb.qps.begin();
+	     i != lb.qps.end(); i++)
+		if (i->second->qp.srq == srq)
+			lb_drain(i->second);
+	return 0;
+}
+
+static int lb_poll_cq(struct ibv_cq *ibcq, int n, struct ibv_wc *wc)
+{
+	struct lb_cq *cq = lb_cq_of(ibcq);
+	int i;
+	lb_guard g;
+
+	lb.polls++;
+	for (i = 0; i < n && cq->wc.size(); i++) {
+		wc[i] = cq->wc.front();
+		cq->wc.pop_front();
+		cq->ts.pop_front();
+	}
+	return i;
+}
+
+static int lb_req_notify_cq(struct ibv_cq *cq, int solicited_only)
+{
+	lb_guard g;
+
+	/* like the HCA, unpolled completions fire the event right away */
+	lb_cq_of(cq)->armed = 1;
+	if (lb_cq_of(cq)->wc.size() && !lb_defer(lb_cq_of(cq)))
+		lb_event(lb_cq_of(cq));
+	return 0;
+}
+
+static int lb_modify_cq(struct ibv_cq *cq, struct ibv_modify_cq_attr *attr)
+{
+	lb_guard g;
+
+	if (attr->attr_mask & ~IBV_CQ_ATTR_MODERATE)
+		return EINVAL;
+	if (attr->attr_mask & IBV_CQ_ATTR_MODERATE) {
+		lb_cq_of(cq)->moder_count = attr->moderate.cq_count;
+		lb_cq_of(cq)->moder_period = attr->moderate.cq_period;
+	}
+	return 0;
+}
+
+/* extended CQ, the lock is held from a successful start_poll to end_poll */
+
+static int lb_next(struct lb_cq *cq)
+{
+	if (cq->wc.empty())
+		return ENOENT;
+	cq->cur = cq->wc.front();
+	cq->cur_ts = cq->ts.front();
+	cq->wc.pop_front();
+	cq->ts.pop_front();
+	cq->cq.wr_id = cq->cur.wr_id;
+	cq->cq.status = cq->cur.status;
+	return 0;
+}
+
+static int lb_start_poll(struct ibv_cq_ex *ibcq, struct ibv_poll_cq_attr *attr)
+{
+	int ret;
+
+	pthread_mutex_lock(&lb.lock);
+	lb.polls++;
+	ret = lb_next(lb_cq_of(ibcq));
+	if (ret)
+		pthread_mutex_unlock(&lb.lock);
+	return ret;
+}
+
+static int lb_next_poll(struct ibv_cq_ex *ibcq)
+{
+	return lb_next(lb_cq_of(ibcq));
+}
+
+static void lb_end_poll(struct ibv_cq_ex *ibcq)
+{
+	pthread_mutex_unlock(&lb.lock);
+}
+
+static enum ibv_wc_opcode lb_read_opcode(struct ibv_cq_ex *cq) { return lb_cq_of(cq)->cur.opcode; }
+static uint32_t lb_read_vendor_err(struct ibv_cq_ex *cq) { return lb_cq_of(cq)->cur.vendor_err; }
+static uint32_t lb_read_byte_len(struct ibv_cq_ex *cq) { return lb_cq_of(cq)->cur.byte_len; }
+static __be32 lb_read_imm_data(struct ibv_cq_ex *cq) { return lb_cq_of(cq)->cur.imm_data; }
+static uint32_t lb_read_qp_num(struct ibv_cq_ex *cq) { return lb_cq_of(cq)->cur.qp_num; }
+static uint32_t lb_read_src_qp(struct ibv_cq_ex *cq) { return lb_cq_of(cq)->cur.src_qp; }
+static unsigned int lb_read_wc_flags(struct ibv_cq_ex *cq) { return lb_cq_of(cq)->cur.wc_flags; }
+static uint32_t lb_read_slid(struct ibv_cq_ex *cq) { return lb_cq_of(cq)->cur.slid; }
+static uint8_t lb_read_sl(struct ibv_cq_ex *cq) { return lb_cq_of(cq)->cur.sl; }
+static uint8_t lb_read_dlid_path_bits(struct ibv_cq_ex *cq) { return lb_cq_of(cq)->cur.dlid_path_bits; }
+static uint64_t lb_read_completion_ts(struct ibv_cq_ex *cq) { return lb_cq_of(cq)->cur_ts; }
+
+static struct ibv_cq_ex *lb_create_cq_ex(struct ibv_context *ctx,
+					 struct ibv_cq_init_attr_ex *attr)
+{
+	struct lb_cq *cq;
+
+	if (attr->cqe < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	cq = new lb_cq();
+	cq->cq.context = ctx;
+	cq->cq.channel = attr->channel;
+	cq->cq.cq_context = attr->cq_context;
+	cq->cq.cqe = attr->cqe;
+	pthread_mutex_init(&cq->cq.mutex, NULL);
+	pthread_cond_init(&cq->cq.cond, NULL);
+	cq->cq.start_poll = lb_start_poll;
+	cq->cq.next_poll = lb_next_poll;
+	cq->cq.end_poll = lb_end_poll;
+	cq->cq.read_opcode = lb_read_opcode;
+	cq->cq.read_vendor_err = lb_read_vendor_err;
+	cq->cq.read_byte_len = lb_read_byte_len;
+	cq->cq.read_imm_data = lb_read_imm_data;
+	cq->cq.read_qp_num = lb_read_qp_num;
+	cq->cq.read_src_qp = lb_read_src_qp;
+	cq->cq.read_wc_flags = lb_read_wc_flags;
+	cq->cq.read_slid = lb_read_slid;
+	cq->cq.read_sl = lb_read_sl;
+	cq->cq.read_dlid_path_bits = lb_read_dlid_path_bits;
+	cq->cq.read_completion_ts = lb_read_completion_ts;
+	return &cq->cq;
+}
+
+static struct ibv_qp *lb_create_qp_ex(struct ibv_context *ctx,
+				      struct ibv_qp_init_attr_ex *attr)
+{
+	uint32_t comp_mask = IBV_QP_INIT_ATTR_PD;
+	struct lb_qp *qp;
+	lb_guard g;
+
+#if HAVE_DECL_IBV_WR_START
+	comp_mask |= IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+	if ((attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) &&
+	    (attr->send_ops_flags & ~(uint64_t)(IBV_QP_EX_WITH_SEND |
+						IBV_QP_EX_WITH_RDMA_WRITE |
+						IBV_QP_EX_WITH_RDMA_READ))) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+#endif
+	if (!(attr->comp_mask & IBV_QP_INIT_ATTR_PD) ||
+	    (attr->comp_mask & ~comp_mask) ||
+	    (attr->qp_type != IBV_QPT_RC && attr->qp_type != IBV_QPT_UD)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	qp = new lb_qp();
+	qp->qp.context = ctx;
+	qp->qp.qp_context = attr->qp_context;
+	qp->qp.pd = attr->pd;
+	qp->qp.send_cq = attr->send_cq;
+	qp->qp.recv_cq = attr->recv_cq;
+	qp->qp.srq = attr->srq;
+	qp->qp.qp_num = lb.next_qpn++;
+	qp->qp.state = IBV_QPS_RESET;
+	qp->qp.qp_type = attr->qp_type;
+	pthread_mutex_init(&qp->qp.mutex, NULL);
+	pthread_cond_init(&qp->qp.cond, NULL);
+	qp->sq_sig_all = attr->sq_sig_all;
+	qp->cap = attr->cap;
+#if HAVE_DECL_IBV_WR_START
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) {
+		qp->send_ops_flags = attr->send_ops_flags;
+		qp->x.qp = qp;
+		qp->x.qpx.qp_base = qp->qp;
+		qp->x.qpx.wr_start = lb_wr_start;
+		qp->x.qpx.wr_complete = lb_wr_complete;
+		qp->x.qpx.wr_abort = lb_wr_abort;
+		qp->x.qpx.wr_send = lb_wr_send;
+		qp->x.qpx.wr_rdma_write = lb_wr_rdma_write;
+		qp->x.qpx.wr_rdma_read = lb_wr_rdma_read;
+		qp->x.qpx.wr_set_sge = lb_wr_set_sge;
+		qp->x.qpx.wr_set_inline_data = lb_wr_set_inline_data;
+	}
+#endif
+	lb.qps[qp->qp.qp_num] = qp;
+	return &qp->qp;
+}
+
+static struct ibv_srq *lb_create_srq_ex(struct ibv_context *ctx,
+					struct ibv_srq_init_attr_ex *attr)
+{
+	struct lb_srq *srq;
+
+	if (!(attr->comp_mask & IBV_SRQ_INIT_ATTR_PD) ||
+	    ((attr->comp_mask & IBV_SRQ_INIT_ATTR_TYPE) &&
+	     attr->srq_type != IBV_SRQT_BASIC)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	srq = new lb_srq();
+	srq->srq.context = ctx;
+	srq->srq.srq_context = attr->srq_context;
+	srq->srq.pd = attr->pd;
+	pthread_mutex_init(&srq->srq.mutex, NULL);
+	pthread_cond_init(&srq->srq.cond, NULL);
+	return &srq->srq;
+}
+
+static void lb_device_attr(struct ibv_context *ctx, struct ibv_device_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	snprintf(attr->fw_ver, sizeof(attr->fw_ver), "loopback");
+	attr->node_guid = htobe64(0x1000 + (ctx->device - lb.dev));
+	attr->sys_image_guid = attr->node_guid;
+	attr->max_mr_size = UINT64_MAX;
+	attr->page_size_cap = 0xfffff000;
+	attr->max_qp = 1 << 18;
+	attr->max_qp_wr = 1 << 15;
+	attr->device_cap_flags = IBV_DEVICE_RC_RNR_NAK_GEN;
+	attr->max_sge = 32;
+	attr->max_cq = 1 << 16;
+	attr->max_cqe = 1 << 22;
+	attr->max_mr = 1 << 20;
+	attr->max_pd = 1 << 16;
+	attr->max_qp_rd_atom = 16;
+	attr->max_qp_init_rd_atom = 16;
+	attr->atomic_cap = IBV_ATOMIC_HCA;
+	attr->max_ah = 1 << 16;
+	attr->max_srq = 1 << 16;
+	attr->max_srq_wr = 1 << 15;
+	attr->max_srq_sge = 32;
+	attr->max_pkeys = 1;
+	attr->phys_port_cnt = 1;
+}
+
+static int lb_query_device_ex(struct ibv_context *ctx,
+			      const struct ibv_query_device_ex_input *input,
+			      struct ibv_device_attr_ex *attr, size_t attr_size)
+{
+	memset(attr, 0, attr_size);
+	lb_device_attr(ctx, &attr->orig_attr);
+	attr->hca_core_clock = sys_tsc_per_us() * 1000;
+	return 0;
+}
+
+static int lb_query_rt_values(struct ibv_context *ctx,
+			      struct ibv_values_ex *values)
+{
+	if (values->comp_mask & ~IBV_VALUES_MASK_RAW_CLOCK)
+		return EINVAL;
+	values->raw_clock.tv_sec = 0;
+	values->raw_clock.tv_nsec = sys_rdtsc();
+	return 0;
+}
+
+static int lb_query_port(struct ibv_context *ctx, uint8_t port,
+			 struct ibv_port_attr *attr, size_t attr_size)
+{
+	if (port != 1)
+		return EINVAL;
+	memset(attr, 0, attr_size);
+	attr->state = IBV_PORT_ACTIVE;
+	attr->max_mtu = IBV_MTU_4096;
+	attr->active_mtu = IBV_MTU_4096;
+	attr->gid_tbl_len = 1;
+	attr->max_msg_sz = 1 << 30;
+	attr->pkey_tbl_len = 1;
+	attr->lid = 1 + (ctx->device - lb.dev);
+	attr->sm_lid = 1;
+	attr->lmc = 0;
+	attr->max_vl_num = 1;
+	attr->active_width = 2;
+	attr->active_speed = 32;
+	attr->phys_state = 5;
+	attr->link_layer = IBV_LINK_LAYER_INFINIBAND;
+	return 0;
+}
+
+/* interposed entry points */
+
+struct ibv_device **ibv_get_device_list(int *num_devices)
+{
+	struct ibv_device **list;
+
+	if (!lb.devices)
+		return REAL(ibv_get_device_list)(num_devices);
+	list = (struct ibv_device **)calloc(lb.devices + 1, sizeof(*list));
+	if (!list)
+		return NULL;
+	for (int i = 0; i < lb.devices; i++)
+		list[i] = &lb.dev[i];
+	if (num_devices)
+		*num_devices = lb.devices;
+	return list;
+}
+
+void ibv_free_device_list(struct ibv_device **list)
+{
+	if (!lb.devices)
+		return REAL(ibv_free_device_list)(list);
+	free(list);
+}
+
+const char *ibv_get_device_name(struct ibv_device *dev)
+{
+	if (!lb_dev(dev))
+		return REAL(ibv_get_device_name)(dev);
+	return dev->name;
+}
+
+struct ibv_context *ibv_open_device(struct ibv_device *dev)
+{
+	struct verbs_context *vctx;
+
+	if (!lb_dev(dev))
+		return REAL(ibv_open_device)(dev);
+
+	vctx = (struct verbs_context *)calloc(1, sizeof(*vctx));
+	if (!vctx)
+		return NULL;
+	vctx->sz = sizeof(*vctx);
+	vctx->query_port = lb_query_port;
+	vctx->query_device_ex = lb_query_device_ex;
+	vctx->create_cq_ex = lb_create_cq_ex;
+	vctx->create_qp_ex = lb_create_qp_ex;
+	vctx->create_srq_ex = lb_create_srq_ex;
+	vctx->modify_cq = lb_modify_cq;
+	vctx->query_rt_values = lb_query_rt_values;
+	vctx->context.device = dev;
+	vctx->context.cmd_fd = -1;
+	vctx->context.async_fd = -1;
+	vctx->context.num_comp_vectors = 1;
+	vctx->context.abi_compat = __VERBS_ABI_IS_EXTENDED;
+	vctx->context.ops.post_send = lb_post_send;
+	vctx->context.ops.post_recv = lb_post_recv;
+	vctx->context.ops.post_srq_recv = lb_post_srq_recv;
+	vctx->context.ops.poll_cq = lb_poll_cq;
+	vctx->context.ops.req_notify_cq = lb_req_notify_cq;
+	pthread_mutex_init(&vctx->context.mutex, NULL);
+	return &vctx->context;
+}
+
+int ibv_close_device(struct ibv_context *ctx)
+{
+	if (!lb_ctx(ctx))
+		return REAL(ibv_close_device)(ctx);
+	free(verbs_get_ctx(ctx));
+	return 0;
+}
+
+int ibv_query_device(struct ibv_context *ctx, struct ibv_device_attr *attr)
+{
+	if (!lb_ctx(ctx))
+		return REAL(ibv_query_device)(ctx, attr);
+	lb_device_attr(ctx, attr);
+	return 0;
+}
+
+int ibv_query_gid(struct ibv_context *ctx, uint8_t port_num, int index,
+		  union ibv_gid *gid)
+{
+	if (!lb_ctx(ctx))
+		return REAL(ibv_query_gid)(ctx, port_num, index, gid);
+	if (port_num != 1 || index)
+		return EINVAL;
+	memset(gid, 0, sizeof(*gid));
+	gid->global.subnet_prefix = htobe64(0xfe80000000000000ULL);
+	gid->global.interface_id = htobe64(0x1000 + (ctx->device - lb.dev));
+	return 0;
+}
+
+struct ibv_pd *ibv_alloc_pd(struct ibv_context *ctx)
+{
+	struct ibv_pd *pd;
+
+	if (!lb_ctx(ctx))
+		return REAL(ibv_alloc_pd)(ctx);
+	pd = (struct ibv_pd *)calloc(1, sizeof(*pd));
+	if (pd)
+		pd->context = ctx;
+	return pd;
+}
+
+int ibv_dealloc_pd(struct ibv_pd *pd)
+{
+	if (!lb_ctx(pd->context))
+		return REAL(ibv_dealloc_pd)(pd);
+	free(pd);
+	return 0;
+}
+
+static struct ibv_mr *lb_reg_mr(struct ibv_pd *pd, void *addr, size_t length,
+				int access)
+{
+	struct lb_mr *mr;
+	lb_guard g;
+
+	if (access & IBV_ACCESS_ON_DEMAND) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	if (!addr) {
+		errno = EINVAL;
+		return NULL;
+	}
+	mr = new lb_mr();
+	mr->mr.context = pd->context;
+	mr->mr.pd = pd;
+	mr->mr.addr = addr;
+	mr->mr.length = length;
+	mr->mr.lkey = mr->mr.rkey = lb.next_key++;
+	mr->access = access;
+	lb.mrs[mr->mr.lkey] = mr;
+	lb.reg_mr++;
+	return &mr->mr;
+}
+
+struct ibv_mr *ibv_reg_mr(struct ibv_pd *pd, void *addr, size_t length, int access)
+{
+	if (!lb_ctx(pd->context))
+		return REAL(ibv_reg_mr)(pd, addr, length, access);
+	return lb_reg_mr(pd, addr, length, access);
+}
+
+struct ibv_mr *ibv_reg_mr_iova2(struct ibv_pd *pd, void *addr, size_t length,
+				uint64_t iova, unsigned int access)
+{
+	if (!lb_ctx(pd->context))
+		return REAL(ibv_reg_mr_iova2)(pd, addr, length, iova, access);
+	return lb_reg_mr(pd, addr, length, access);
+}
+
+int ibv_dereg_mr(struct ibv_mr *mr)
+{
+	if (!lb_ctx(mr->context))
+		return REAL(ibv_dereg_mr)(mr);
+
+	lb_guard g;
+
+	lb.mrs.erase(mr->lkey);
+	delete (struct lb_mr *)mr;
+	return 0;
+}
+
+struct ibv_comp_channel *ibv_create_comp_channel(struct ibv_context *ctx)
+{
+	struct lb_channel *ch;
+	int fd[2];
+
+	if (!lb_ctx(ctx))
+		return REAL(ibv_create_comp_channel)(ctx);
+	if (pipe(fd))
+		return NULL;
+	ch = (struct lb_channel *)calloc(1, sizeof(*ch));
+	ch->channel.context = ctx;
+	ch->channel.fd = fd[0];
+	ch->wfd = fd[1];
+	return &ch->channel;
+}
+
+int ibv_destroy_comp_channel(struct ibv_comp_channel *channel)
+{
+	struct lb_channel *ch = (struct lb_channel *)channel;
+
+	if (!lb_ctx(channel->context))
+		return REAL(ibv_destroy_comp_channel)(channel);
+	close(ch->channel.fd);
+	close(ch->wfd);
+	free(ch);
+	return 0;
+}
+
+int ibv_get_cq_event(struct ibv_comp_channel *channel, struct ibv_cq **cq,
+		     void **cq_context)
+{
+	struct lb_cq *lcq;
+
+	if (!lb_ctx(channel->context))
+		return REAL(ibv_get_cq_event)(channel, cq, cq_context);
+	for (;;) {
+		struct pollfd pfd = { channel->fd, POLLIN, 0 };
+		int timeout = -1;
+
+		/* nothing runs in the background, expire held back events */
+		{
+			lb_guard g;
+			std::vector<lb_cq *> m = lb.moderated;
+
+			for (size_t i = 0; i < m.size(); i++) {
+				double left = m[i]->moder_since +
+					      m[i]->moder_period - sys_gettime();
+
+				if (m[i]->cq.channel != channel ||
+				    !m[i]->moder_period)
+					continue;
+				if (left <= 0)
+					lb_event(m[i]);
+				else if (timeout < 0 || left / 1000 + 1 < timeout)
+					timeout = left / 1000 + 1;
+			}
+		}
+		if (poll(&pfd, 1, timeout) > 0)
+			break;
+	}
+	if (read(channel->fd, &lcq, sizeof(lcq)) != sizeof(lcq))
+		return -1;
+	*cq = ibv_cq_ex_to_cq(&lcq->cq);
+	*cq_context = lcq->cq.cq_context;
+	return 0;
+}
+
+void ibv_ack_cq_events(struct ibv_cq *cq, unsigned int nevents)
+{
+	if (!lb_ctx(cq->context))
+		return REAL(ibv_ack_cq_events)(cq, nevents);
+}
+
+struct ibv_cq *ibv_create_cq(struct ibv_context *ctx, int cqe, void *cq_context,
+			     struct ibv_comp_channel *channel, int comp_vector)
+{
+	struct ibv_cq_init_attr_ex attr = {};
+
+	if (!lb_ctx(ctx))
+		return REAL(ibv_create_cq)(ctx, cqe, cq_context, channel, comp_vector);
+	attr.cqe = cqe;
+	attr.cq_context = cq_context;
+	attr.channel = channel;
+	attr.comp_vector = comp_vector;
+	return ibv_cq_ex_to_cq(lb_create_cq_ex(ctx, &attr));
+}
+
+int ibv_destroy_cq(struct ibv_cq *cq)
+{
+	if (!lb_ctx(cq->context))
+		return REAL(ibv_destroy_cq)(cq);
+	{
+		lb_guard g;
+
+		/* like the HCA, refuse while a QP still completes to it */
+		for (std::map<uint32_t, lb_qp *>::iterator i = lb.qps.begin();
+		     i != lb.qps.end(); i++)
+			if (i->second->qp.send_cq == cq ||
+			    i->second->qp.recv_cq == cq)
+				return EBUSY;
+		lb_unmoderate(lb_cq_of(cq));
+	}
+	delete lb_cq_of(cq);
+	return 0;
+}
+
+struct ibv_srq *ibv_create_srq(struct ibv_pd *pd, struct ibv_srq_init_attr *attr)
+{
+	struct ibv_srq_init_attr_ex attr_ex = {};
+
+	if (!lb_ctx(pd->context))
+		return REAL(ibv_create_srq)(pd, attr);
+	attr_ex.srq_context = attr->srq_context;
+	attr_ex.attr = attr->attr;
+	attr_ex.comp_mask = IBV_SRQ_INIT_ATTR_PD;
+	attr_ex.pd = pd;
+	return lb_create_srq_ex(pd->context, &attr_ex);
+}
+
+int ibv_destroy_srq(struct ibv_srq *srq)
+{
+	if (!lb_ctx(srq->context))
+		return REAL(ibv_destroy_srq)(srq);
+	delete lb_srq_of(srq);
+	return 0;
+}
+
+struct ibv_qp *ibv_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
+{
+	struct ibv_qp_init_attr_ex attr_ex = {};
+
+	if (!lb_ctx(pd->context))
+		return REAL(ibv_create_qp)(pd, attr);
+	memcpy(&attr_ex, attr, sizeof(*attr));
+	attr_ex.comp_mask = IBV_QP_INIT_ATTR_PD;
+	attr_ex.pd = pd;
+	return lb_create_qp_ex(pd->context, &attr_ex);
+}
+
+int ibv_modify_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr, int mask)
+{
+	if (!lb_ctx(ibqp->context))
+		return REAL(ibv_modify_qp)(ibqp, attr, mask);
+
+	struct lb_qp *qp = lb_qp_of(ibqp);
+	lb_guard g;
+
+	lb.modify_qp++;
+	if (mask & IBV_QP_ACCESS_FLAGS)
+		qp->access = attr->qp_access_flags;
+	if (mask & IBV_QP_QKEY)
+		qp->qkey = attr->qkey;
+	if (mask & IBV_QP_DEST_QPN)
+		qp->dest_qpn = attr->dest_qp_num;
+	if (mask & IBV_QP_STATE) {
+		qp->qp.state = attr->qp_state;
+		if (attr->qp_state == IBV_QPS_RESET) {
+			qp->rq.clear();
+			qp->pending.clear();
+		} else if (attr->qp_state == IBV_QPS_ERR) {
+			lb_flush(qp);
+		}
+	}
+	return 0;
+}
+
+int ibv_query_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr, int mask,
+		 struct ibv_qp_init_attr *init_attr)
+{
+	struct lb_qp *qp = lb_qp_of(ibqp);
+
+	if (!lb_ctx(ibqp->context))
+		return REAL(ibv_query_qp)(ibqp, attr, mask, init_attr);
+	memset(attr, 0, sizeof(*attr));
+	memset(init_attr, 0, sizeof(*init_attr));
+	attr->qp_state = qp->qp.state;
+	attr->cur_qp_state = qp->qp.state;
+	attr->qp_access_flags = qp->access;
+	attr->qkey = qp->qkey;
+	attr->dest_qp_num = qp->dest_qpn;
+	attr->cap = qp->cap;
+	init_attr->cap = qp->cap;
+	init_attr->send_cq = qp->qp.send_cq;
+	init_attr->recv_cq = qp->qp.recv_cq;
+	init_attr->srq = qp->qp.srq;
+	init_attr->qp_type = qp->qp.qp_type;
+	init_attr->sq_sig_all = qp->sq_sig_all;
+	return 0;
+}
+
+int ibv_destroy_qp(struct ibv_qp *ibqp)
+{
+	if (!lb_ctx(ibqp->context))
+		return REAL(ibv_destroy_qp)(ibqp);
+
+	struct lb_qp *qp = lb_qp_of(ibqp);
+	lb_guard g;
+
+	lb.qps.erase(qp->qp.qp_num);
+	for (std::map<uint32_t, lb_qp *>::iterator i = lb.qps.begin();
+	     i != lb.qps.end(); i++) {
+		std::deque<lb_msg> &p = i->second->pending;
+
+		for (std::deque<lb_msg>::iterator m = p.begin(); m != p.end(); )
+			m = m->src == qp ? p.erase(m) : m + 1;
+	}
+	delete qp;
+	return 0;
+}
+
+#if HAVE_DECL_IBV_WR_START
+struct ibv_qp_ex *ibv_qp_to_qp_ex(struct ibv_qp *ibqp)
+{
+	struct lb_qp *qp = lb_qp_of(ibqp);
+
+	if (!lb_ctx(ibqp->context))
+		return REAL(ibv_qp_to_qp_ex)(ibqp);
+	return qp->send_ops_flags ? &qp->x.qpx : NULL;
+}
+#endif
+
+struct ibv_ah *ibv_create_ah(struct ibv_pd *pd, struct ibv_ah_attr *attr)
+{
+	struct lb_ah *ah;
+
+	if (!lb_ctx(pd->context))
+		return REAL(ibv_create_ah)(pd, attr);
+	ah = new lb_ah();
+	ah->ah.context = pd->context;
+	ah->ah.pd = pd;
+	ah->attr = *attr;
+	return &ah->ah;
+}
+
+int ibv_destroy_ah(struct ibv_ah *ah)
+{
+	if (!lb_ctx(ah->context))
+		return REAL(ibv_destroy_ah)(ah);
+	delete (struct lb_ah *)ah;
+	return 0;
+}
+
+/* no direct verbs on loopback devices */
+#if HAVE_DECL_MLX5DV_CONTEXT_FLAGS_DEVX
+struct ibv_context *mlx5dv_open_device(struct ibv_device *dev,
+				       struct mlx5dv_context_attr *attr)
+{
+	if (!lb_dev(dev))
+		return REAL(mlx5dv_open_device)(dev, attr);
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+#endif
+
+#if HAVE_DECL_MLX5DV_INIT_OBJ
+int mlx5dv_init_obj(struct mlx5dv_obj *obj, uint64_t obj_type)
+{
+	if (((obj_type & MLX5DV_OBJ_QP) && lb_ctx(obj->qp.in->context)) ||
+	    ((obj_type & MLX5DV_OBJ_CQ) && lb_ctx(obj->cq.in->context)) ||
+	    ((obj_type & MLX5DV_OBJ_SRQ) && lb_ctx(obj->srq.in->context)) ||
+	    ((obj_type & MLX5DV_OBJ_PD) && lb_ctx(obj->pd.in->context)))
+		return EOPNOTSUPP;
+	return REAL(mlx5dv_init_obj)(obj, obj_type);
+}
+#endif
+
+#if HAVE_DECL_MLX5DV_DCTYPE_DCT
+struct ibv_qp *mlx5dv_create_qp(struct ibv_context *ctx,
+				struct ibv_qp_init_attr_ex *attr,
+				struct mlx5dv_qp_init_attr *mlx5_attr)
+{
+	if (!lb_ctx(ctx))
+		return REAL(mlx5dv_create_qp)(ctx, attr, mlx5_attr);
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+#endif
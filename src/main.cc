@@ -35,12 +35,18 @@
 
 
 GTEST_API_ int main(int argc, char **argv) {
+  if (argc > 1 && !strcmp(argv[1], "--ring-decode"))
+    return sys_ring_decode(argc - 2, argv + 2);
+
   std::cout << "Running main() from main.cc\n";
 
   sys_getenv();
+  int rc = 0;
+  if (sys_parallel(&argc, argv, &rc))
+    return rc;
   testing::GTEST_FLAG(print_time) = true;
   testing::InitGoogleTest(&argc, argv);
-  int rc = RUN_ALL_TESTS();
+  rc = RUN_ALL_TESTS();
   std::cout << "[  USAGE   ] http://github.com/mellanox-hpc/ibverbs-tests/wiki/Usage\n\n";
   return rc;
 }
@@ -28,9 +28,27 @@
  */
 
 #include "common.h"
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <infiniband/verbs.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 uint32_t gtest_debug_mask = GTEST_LOG_ERR | GTEST_LOG_NOTICE;
 char *gtest_dev_name;
+uint32_t gtest_ring_size;
+__thread struct sys_ring *sys_ring_self;
 
 
 void sys_hexdump(void *ptr, int buflen)
@@ -88,3 +106,921 @@ uint32_t sys_inet_addr(char* ip)
 
 	return *((uint32_t *)addr);
 }
+
+/* rdtsc ticks per microsecond, calibrated once against gettimeofday */
+double sys_tsc_per_us(void)
+{
+	static double rate;
+
+	if (!rate) {
+		double start = sys_gettime();
+		uint64_t tsc = sys_rdtsc();
+
+		while (sys_gettime() - start < 10000)
+			;
+		rate = (sys_rdtsc() - tsc) / (sys_gettime() - start);
+	}
+	return rate;
+}
+
+static cpu_set_t pin_process;
+static cpu_set_t pin_allowed;
+static int pin_count;
+
+static void pin_init_once(void)
+{
+	if (sched_getaffinity(0, sizeof(pin_process), &pin_process))
+		return;
+	pin_allowed = pin_process;
+	pin_count = CPU_COUNT(&pin_allowed);
+}
+
+/* worker threads pin themselves concurrently, the mask is read once */
+static int pin_init(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, pin_init_once);
+	return pin_count ? 0 : -1;
+}
+
+/* pin the calling thread to the n-th CPU (modulo) of the process mask */
+int sys_pin_cpu(int n)
+{
+	cpu_set_t set;
+
+	if (pin_init())
+		return -1;
+	n %= pin_count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &pin_allowed) || n--)
+			continue;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			return -1;
+		return cpu;
+	}
+	return -1;
+}
+
+/* narrow the CPUs sys_pin_cpu() picks from to those of set */
+int sys_pin_cpus(const cpu_set_t *set)
+{
+	cpu_set_t both;
+
+	if (pin_init())
+		return -1;
+	CPU_AND(&both, &pin_process, set);
+	if (!CPU_COUNT(&both))
+		return -1;
+	pin_allowed = both;
+	pin_count = CPU_COUNT(&both);
+	return 0;
+}
+
+/* back to the CPUs the process started with, for the calling thread too */
+int sys_pin_reset(void)
+{
+	if (pin_init())
+		return -1;
+	pin_allowed = pin_process;
+	pin_count = CPU_COUNT(&pin_process);
+	return pthread_setaffinity_np(pthread_self(), sizeof(pin_process),
+				      &pin_process);
+}
+
+static int parse_list(char *p, cpu_set_t *set)
+{
+	char *tok;
+
+	CPU_ZERO(set);
+	while ((tok = strsep(&p, ",\n"))) {
+		int lo, hi;
+
+		switch (sscanf(tok, "%d-%d", &lo, &hi)) {
+		case 1:
+			hi = lo;
+			break;
+		case 2:
+			break;
+		default:
+			continue;
+		}
+		for (int i = lo; i <= hi && i < CPU_SETSIZE; i++)
+			CPU_SET(i, set);
+	}
+	return CPU_COUNT(set);
+}
+
+/* read a sysfs CPU or node list like "0-3,8,10-11", returns its size */
+int sys_read_list(const char *path, cpu_set_t *set)
+{
+	char buf[4096];
+	int fd, len;
+
+	CPU_ZERO(set);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = 0;
+	return parse_list(buf, set);
+}
+
+/* nodes the cpuset of the process lets it allocate memory from */
+int sys_mems_allowed(cpu_set_t *set)
+{
+	char buf[8192], *p;
+	int fd, len;
+
+	CPU_ZERO(set);
+	fd = open("/proc/self/status", O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = 0;
+	p = strstr(buf, "Mems_allowed_list:");
+	if (!p)
+		return -1;
+	p += strlen("Mems_allowed_list:");
+	p[strcspn(p, "\n")] = 0;
+	return parse_list(p + strspn(p, " \t"), set);
+}
+
+/* another node with CPUs and memory the process may use, -1 if none */
+int sys_numa_remote(int node)
+{
+	cpu_set_t mem, cpu, allowed;
+
+	if (sys_read_list("/sys/devices/system/node/has_memory", &mem) <= 0 ||
+	    sys_read_list("/sys/devices/system/node/has_cpu", &cpu) <= 0)
+		return -1;
+	/* mbind() outside of the cpuset fails with EINVAL */
+	if (sys_mems_allowed(&allowed) > 0)
+		CPU_AND(&mem, &mem, &allowed);
+	for (int n = 0; n < CPU_SETSIZE; n++)
+		if (n != node && CPU_ISSET(n, &mem) && CPU_ISSET(n, &cpu))
+			return n;
+	return -1;
+}
+
+#define SYS_MPOL_BIND		2
+#define SYS_MPOL_MF_MOVE	(1 << 1)
+
+/* bind memory to a node, pages already faulted in are moved there */
+int sys_mbind(void *addr, size_t len, int node)
+{
+	unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = {};
+
+	if (node < 0 || node >= CPU_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+	return syscall(SYS_mbind, addr, len, SYS_MPOL_BIND, mask,
+		       CPU_SETSIZE, SYS_MPOL_MF_MOVE);
+}
+
+/*
+ * munmap, mremap and madvise(MADV_DONTNEED) are interposed so that
+ * whatever caches registrations (ibvt_mr_cache) learns when pages under
+ * them go away, no matter who drops them. The hook runs before the real
+ * call, while the range is still mapped, and not again from inside
+ * itself.
+ */
+void (*sys_unmap_hook)(void *addr, size_t len);
+static __thread int unmap_busy;
+
+static void unmap_notify(void *addr, size_t len)
+{
+	if (!sys_unmap_hook || unmap_busy)
+		return;
+	unmap_busy = 1;
+	sys_unmap_hook(addr, len);
+	unmap_busy = 0;
+}
+
+extern "C" int munmap(void *addr, size_t len) __THROW
+{
+	unmap_notify(addr, len);
+	return REAL(munmap)(addr, len);
+}
+
+extern "C" void *mremap(void *addr, size_t old_len, size_t new_len,
+			int flags, ...) __THROW
+{
+	void *new_addr = NULL;
+	va_list ap;
+
+	if (flags & MREMAP_FIXED) {
+		va_start(ap, flags);
+		new_addr = va_arg(ap, void *);
+		va_end(ap);
+		/* whatever was at the target is dropped as well */
+		unmap_notify(new_addr, new_len);
+	}
+	/* moved or not, pinned pages no longer back the old range */
+	unmap_notify(addr, old_len);
+	return REAL(mremap)(addr, old_len, new_len, flags, new_addr);
+}
+
+extern "C" int madvise(void *addr, size_t len, int advice) __THROW
+{
+	switch (advice) {
+	case MADV_DONTNEED:
+	case MADV_REMOVE:
+#ifdef MADV_FREE
+	case MADV_FREE:
+#endif
+		unmap_notify(addr, len);
+		break;
+	}
+	return REAL(madvise)(addr, len, advice);
+}
+
+/*
+ * Test pattern kernels: buffer byte i holds (i + shift) & 0xff. Vector
+ * widths are picked at runtime, IBV_TEST_SIMD=scalar|sse2|avx2|avx512
+ * forces a narrower one.
+ */
+struct sys_pattern_table {
+	unsigned char pat[256 + 64] ALIGN(64);
+
+	sys_pattern_table() {
+		for (size_t i = 0; i < sizeof(pat); i++)
+			pat[i] = i & 0xff;
+	}
+};
+
+static const sys_pattern_table pattern_table;
+
+#define PAT(i) (pattern_table.pat + ((i) & 0xff))
+
+static void fill_scalar(char *buf, size_t start, size_t end, size_t shift)
+{
+	for (size_t i = start; i < end; i++)
+		buf[i] = (i + shift) & 0xff;
+}
+
+static size_t check_scalar(const char *buf, size_t start, size_t end, size_t shift)
+{
+	for (size_t i = start; i < end; i++)
+		if (buf[i] != (char)((i + shift) & 0xff))
+			return i;
+	return end;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse2")))
+static void fill_sse2(char *buf, size_t start, size_t end, size_t shift)
+{
+	size_t i;
+
+	for (i = start; i + 16 <= end; i += 16)
+		_mm_storeu_si128((__m128i *)(buf + i),
+				 _mm_loadu_si128((const __m128i *)PAT(i + shift)));
+	fill_scalar(buf, i, end, shift);
+}
+
+__attribute__((target("sse2")))
+static size_t check_sse2(const char *buf, size_t start, size_t end, size_t shift)
+{
+	size_t i;
+
+	for (i = start; i + 16 <= end; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)PAT(i + shift));
+		unsigned m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff;
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+	return check_scalar(buf, i, end, shift);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(char *buf, size_t start, size_t end, size_t shift)
+{
+	size_t i;
+
+	for (i = start; i + 32 <= end; i += 32)
+		_mm256_storeu_si256((__m256i *)(buf + i),
+				    _mm256_loadu_si256((const __m256i *)PAT(i + shift)));
+	fill_scalar(buf, i, end, shift);
+}
+
+__attribute__((target("avx2")))
+static size_t check_avx2(const char *buf, size_t start, size_t end, size_t shift)
+{
+	size_t i;
+
+	for (i = start; i + 32 <= end; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)PAT(i + shift));
+		unsigned m = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+	return check_scalar(buf, i, end, shift);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void fill_avx512(char *buf, size_t start, size_t end, size_t shift)
+{
+	size_t i;
+
+	for (i = start; i + 64 <= end; i += 64)
+		_mm512_storeu_si512((void *)(buf + i),
+				    _mm512_loadu_si512((const void *)PAT(i + shift)));
+	fill_scalar(buf, i, end, shift);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t check_avx512(const char *buf, size_t start, size_t end, size_t shift)
+{
+	size_t i;
+
+	for (i = start; i + 64 <= end; i += 64) {
+		__m512i a = _mm512_loadu_si512((const void *)(buf + i));
+		__m512i b = _mm512_loadu_si512((const void *)PAT(i + shift));
+		uint64_t m = _mm512_cmpneq_epi8_mask(a, b);
+		if (m)
+			return i + __builtin_ctzll(m);
+	}
+	return check_scalar(buf, i, end, shift);
+}
+#endif
+
+struct sys_pattern_ops {
+	const char *name;
+	void (*fill)(char *buf, size_t start, size_t end, size_t shift);
+	size_t (*check)(const char *buf, size_t start, size_t end, size_t shift);
+
+	sys_pattern_ops() : name("scalar"), fill(fill_scalar), check(check_scalar) {
+#if defined(__x86_64__)
+		const char *force = getenv("IBV_TEST_SIMD");
+
+		__builtin_cpu_init();
+		if (force && !strcmp(force, "scalar"))
+			return;
+		if (__builtin_cpu_supports("sse2"))
+			set("sse2", fill_sse2, check_sse2);
+		if (force && !strcmp(force, "sse2"))
+			return;
+		if (__builtin_cpu_supports("avx2"))
+			set("avx2", fill_avx2, check_avx2);
+		if (force && !strcmp(force, "avx2"))
+			return;
+		if (__builtin_cpu_supports("avx512bw"))
+			set("avx512", fill_avx512, check_avx512);
+#endif
+	}
+
+	void set(const char *n,
+		 void (*f)(char *, size_t, size_t, size_t),
+		 size_t (*c)(const char *, size_t, size_t, size_t)) {
+		name = n;
+		fill = f;
+		check = c;
+	}
+};
+
+static const sys_pattern_ops &pattern_ops()
+{
+	static const sys_pattern_ops ops;
+	return ops;
+}
+
+const char *sys_pattern_isa(void)
+{
+	return pattern_ops().name;
+}
+
+void sys_fill_pattern(char *buf, size_t start, size_t end, size_t shift)
+{
+	pattern_ops().fill(buf, start, end, shift);
+}
+
+size_t sys_check_pattern(const char *buf, size_t start, size_t end, size_t shift)
+{
+	if (start >= end)
+		return end;
+	return pattern_ops().check(buf, start, end, shift);
+}
+
+/*
+ * --parallel=N: fork N workers per active device:port before gtest
+ * starts, each pinned to its port through IBV_DEV/IBV_TEST_DEV/
+ * IBV_TEST_PORT. Every port runs the whole test list, sharded over its
+ * own N workers. Worker XML reports are merged into the requested
+ * --gtest_output file, with suites prefixed by dev:port/ when there is
+ * more than one port.
+ */
+struct sys_xml_case {
+	std::string text;
+	bool run;
+	bool failed;
+	double time;
+};
+
+struct sys_xml_suite {
+	std::string head;
+	std::string name;
+	int disabled;
+	std::vector<sys_xml_case> cases;
+};
+
+static std::string xml_attr(const std::string &line, const char *name)
+{
+	std::string key = std::string(" ") + name + "=\"";
+	size_t b = line.find(key);
+
+	if (b == std::string::npos)
+		return "";
+	b += key.size();
+	return line.substr(b, line.find('"', b) - b);
+}
+
+static bool xml_load(const std::string &path, std::vector<sys_xml_suite> &suites,
+		     int &tests, int &disabled, double &time)
+{
+	std::ifstream in(path.c_str());
+	std::string line;
+
+	if (!in)
+		return false;
+	while (std::getline(in, line)) {
+		if (!line.compare(0, 12, "<testsuites ")) {
+			tests = atoi(xml_attr(line, "tests").c_str());
+			disabled = atoi(xml_attr(line, "disabled").c_str());
+			time = atof(xml_attr(line, "time").c_str());
+		} else if (!line.compare(0, 13, "  <testsuite ")) {
+			sys_xml_suite suite;
+
+			suite.name = xml_attr(line, "name");
+			suite.disabled = atoi(xml_attr(line, "disabled").c_str());
+			suites.push_back(suite);
+		} else if (!line.compare(0, 14, "    <testcase ") && suites.size()) {
+			sys_xml_case c;
+
+			c.text = line + "\n";
+			c.run = xml_attr(line, "status") == "run";
+			c.time = atof(xml_attr(line, "time").c_str());
+			c.failed = line.compare(line.size() - 3, 3, " />") != 0;
+			while (c.failed && std::getline(in, line)) {
+				c.text += line + "\n";
+				if (line == "    </testcase>")
+					break;
+			}
+			suites.back().cases.push_back(c);
+		}
+	}
+	return true;
+}
+
+/* the same test runs on every port, keep them apart in the report */
+static void xml_rename(sys_xml_suite &suite, const std::string &name)
+{
+	std::string from = " classname=\"" + suite.name + "\"";
+	std::string to = " classname=\"" + name + "\"";
+
+	for (size_t c = 0; c < suite.cases.size(); c++) {
+		std::string &text = suite.cases[c].text;
+		size_t at = text.find(from);
+
+		if (at != std::string::npos)
+			text.replace(at, from.size(), to);
+	}
+	suite.name = name;
+}
+
+/*
+ * Workers slot * per .. slot * per + per - 1 shard the list of one port.
+ * Every shard lists all tests, take each one from the shard that ran it.
+ */
+static void xml_merge(const std::string &path,
+		      const std::vector<std::string> &slots, int per)
+{
+	int workers = slots.size() * per;
+	std::vector<std::vector<sys_xml_suite> > parts(workers);
+	std::vector<sys_xml_suite> merged;
+	int tests = 0, disabled = 0, failures = 0;
+	double time = 0;
+	FILE *out;
+
+	for (int i = 0; i < workers; i++) {
+		std::string part = path + "." + std::to_string(i);
+		int t_tests = 0, t_disabled = 0;
+		double t = 0;
+
+		if (!xml_load(part, parts[i], t_tests, t_disabled, t) ||
+		    parts[i].size() != parts[0].size()) {
+			VERBS_NOTICE("parallel: can't merge %s\n", part.c_str());
+			return;
+		}
+		if (i % per == 0) {
+			tests += t_tests;
+			disabled += t_disabled;
+		}
+		time = std::max(time, t);
+		unlink(part.c_str());
+	}
+
+	for (size_t slot = 0; slot < slots.size(); slot++) {
+		std::vector<sys_xml_suite> &first = parts[slot * per];
+
+		for (size_t s = 0; s < first.size(); s++) {
+			for (size_t c = 0; c < first[s].cases.size(); c++)
+				for (int i = slot * per + 1; i < (int)(slot + 1) * per; i++)
+					if (c < parts[i][s].cases.size() &&
+					    parts[i][s].cases[c].run)
+						first[s].cases[c] = parts[i][s].cases[c];
+			if (slots.size() > 1)
+				xml_rename(first[s], slots[slot] + "/" + first[s].name);
+			merged.push_back(first[s]);
+		}
+	}
+
+	out = fopen(path.c_str(), "w");
+	if (!out) {
+		VERBS_NOTICE("parallel: can't write %s\n", path.c_str());
+		return;
+	}
+	for (size_t s = 0; s < merged.size(); s++)
+		for (size_t c = 0; c < merged[s].cases.size(); c++)
+			failures += merged[s].cases[c].failed;
+	fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(out, "<testsuites tests=\"%d\" failures=\"%d\" disabled=\"%d\" "
+		"errors=\"0\" time=\"%.3f\" name=\"AllTests\">\n",
+		tests, failures, disabled, time);
+	for (size_t s = 0; s < merged.size(); s++) {
+		int f = 0;
+		double t = 0;
+
+		for (size_t c = 0; c < merged[s].cases.size(); c++) {
+			f += merged[s].cases[c].failed;
+			t += merged[s].cases[c].time;
+		}
+		fprintf(out, "  <testsuite name=\"%s\" tests=\"%zu\" failures=\"%d\" "
+			"disabled=\"%d\" errors=\"0\" time=\"%.3f\">\n",
+			merged[s].name.c_str(), merged[s].cases.size(), f,
+			merged[s].disabled, t);
+		for (size_t c = 0; c < merged[s].cases.size(); c++)
+			fputs(merged[s].cases[c].text.c_str(), out);
+		fprintf(out, "  </testsuite>\n");
+	}
+	fprintf(out, "</testsuites>\n");
+	fclose(out);
+}
+
+/* resolve --gtest_output / GTEST_OUTPUT the way gtest does for plain files */
+static std::string xml_output(int argc, char **argv, int &arg)
+{
+	const char *flag = getenv("GTEST_OUTPUT");
+	std::string path;
+
+	arg = 0;
+	for (int i = 1; i < argc; i++)
+		if (!strncmp(argv[i], "--gtest_output=", 15)) {
+			flag = argv[i] + 15;
+			arg = i;
+		}
+	if (!flag || strncmp(flag, "xml", 3))
+		return "";
+	path = flag[3] == ':' ? flag + 4 : "";
+	if (path.empty())
+		path = "test_detail.xml";
+	else if (path[path.size() - 1] == '/')
+		path += "ibv_test.xml";
+	return path;
+}
+
+int sys_parallel(int *argc, char **argv, int *rc)
+{
+	std::vector<std::pair<std::string, int> > slots;
+	struct ibv_device **dev_list;
+	std::vector<std::string> names;
+	std::vector<pid_t> pids;
+	std::string xml;
+	int workers, per = 0;
+	int num_devices = 0;
+	int xml_arg;
+	int n = 1;
+
+	for (int i = 1; i < *argc; i++) {
+		if (strncmp(argv[i], "--parallel=", 11)) {
+			argv[n++] = argv[i];
+			continue;
+		}
+		per = atoi(argv[i] + 11);
+	}
+	*argc = n;
+	argv[n] = NULL;
+	if (per < 1)
+		return 0;
+
+	dev_list = ibv_get_device_list(&num_devices);
+	for (int d = 0; d < num_devices; d++) {
+		const char *name = ibv_get_device_name(dev_list[d]);
+		struct ibv_device_attr dev_attr;
+		struct ibv_context *ctx;
+
+		if (getenv("IBV_DEV") && strcmp(name, getenv("IBV_DEV")))
+			continue;
+		ctx = ibv_open_device(dev_list[d]);
+		if (!ctx)
+			continue;
+		if (!ibv_query_device(ctx, &dev_attr))
+			for (int port = 1; port <= dev_attr.phys_port_cnt; port++) {
+				struct ibv_port_attr port_attr;
+
+				if (!ibv_query_port(ctx, port, &port_attr) &&
+				    port_attr.state == IBV_PORT_ACTIVE)
+					slots.push_back(std::make_pair(std::string(name), port));
+			}
+		ibv_close_device(ctx);
+	}
+	if (dev_list)
+		ibv_free_device_list(dev_list);
+	if (slots.empty()) {
+		VERBS_NOTICE("parallel: no active ports, running serially\n");
+		return 0;
+	}
+	workers = per * slots.size();
+	if (workers < 2)
+		return 0;
+	for (size_t i = 0; i < slots.size(); i++)
+		names.push_back(slots[i].first + ":" +
+				std::to_string(slots[i].second));
+
+	xml = xml_output(*argc, argv, xml_arg);
+	fflush(stdout);
+	for (int i = 0; i < workers; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			VERBS_ERR("parallel: fork failed %d\n", errno);
+			*rc = 1;
+			break;
+		}
+		if (pid) {
+			VERBS_NOTICE("parallel: worker %d pid %d on %s shard %d/%d\n",
+				     i, pid, names[i / per].c_str(), i % per, per);
+			/* or the next child prints it again */
+			fflush(stdout);
+			pids.push_back(pid);
+			continue;
+		}
+
+		std::string shard = std::to_string(i % per);
+		std::string total = std::to_string(per);
+		std::string port = std::to_string(slots[i / per].second);
+		const char *dev = slots[i / per].first.c_str();
+
+		setenv("IBV_DEV", dev, 1);
+		setenv("IBV_TEST_DEV", dev, 1);
+		setenv("IBV_TEST_PORT", port.c_str(), 1);
+		setenv("GTEST_TOTAL_SHARDS", total.c_str(), 1);
+		setenv("GTEST_SHARD_INDEX", shard.c_str(), 1);
+		free(gtest_dev_name);
+		sys_getenv();
+		if (xml.size()) {
+			std::string part = "xml:" + xml + "." + std::to_string(i);
+
+			if (xml_arg)
+				argv[xml_arg] = strdup(("--gtest_output=" + part).c_str());
+			else
+				setenv("GTEST_OUTPUT", part.c_str(), 1);
+		}
+		return 0;
+	}
+
+	for (size_t i = 0; i < pids.size(); i++) {
+		int status = 0;
+
+		waitpid(pids[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			VERBS_NOTICE("parallel: worker %zu failed, status 0x%x\n", i, status);
+			*rc = 1;
+		}
+	}
+	if (xml.size() && pids.size() == (size_t)workers)
+		xml_merge(xml, names, per);
+	return 1;
+}
+
+#define SYS_RING_MAGIC "IBVTRING"
+#define SYS_RING_STAMP __DATE__ " " __TIME__
+
+static pthread_key_t ring_key;
+static __thread struct sys_ring ring_self;
+static __thread int ring_closed;
+
+static void ring_atfork_child(void)
+{
+	sys_ring_self = NULL;
+}
+
+/* thread exit: unmap the ring, later records of this thread are dropped */
+static void ring_close(void *arg)
+{
+	struct sys_ring *ring = (struct sys_ring *)arg;
+
+	munmap(ring->hdr, sizeof(*ring->hdr) +
+	       ring->hdr->size * sizeof(*ring->recs));
+	ring->hdr = NULL;
+	sys_ring_self = NULL;
+	ring_closed = 1;
+}
+
+struct sys_ring *sys_ring_open(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	struct sys_ring *ring;
+	uint64_t size = 1;
+	char path[64];
+	size_t len;
+	void *map;
+	int fd;
+
+	if (ring_closed)
+		return NULL;
+	while (size < gtest_ring_size)
+		size <<= 1;
+	len = sizeof(*ring->hdr) + size * sizeof(*ring->recs);
+	snprintf(path, sizeof(path), "ibv_test.%d.%ld.ring", getpid(),
+		 (long)syscall(SYS_gettid));
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, len)) {
+		VERBS_ERR("ring: can't create %s, errno %d\n", path, errno);
+		gtest_ring_size = 0;
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		VERBS_ERR("ring: can't map %s, errno %d\n", path, errno);
+		gtest_ring_size = 0;
+		return NULL;
+	}
+
+	pthread_once(&once, [] {
+		pthread_atfork(NULL, NULL, ring_atfork_child);
+		pthread_key_create(&ring_key, ring_close);
+	});
+	ring = &ring_self;
+	ring->hdr = (struct sys_ring_hdr *)map;
+	ring->recs = (struct sys_ring_rec *)(ring->hdr + 1);
+	memcpy(ring->hdr->magic, SYS_RING_MAGIC, sizeof(ring->hdr->magic));
+	strncpy(ring->hdr->stamp, SYS_RING_STAMP, sizeof(ring->hdr->stamp) - 1);
+	ring->hdr->anchor = (uintptr_t)SYS_RING_MAGIC;
+	ring->hdr->tsc_per_us = sys_tsc_per_us();
+	ring->hdr->size = size;
+	ring->hdr->tid = syscall(SYS_gettid);
+	pthread_setspecific(ring_key, ring);
+	sys_ring_self = ring;
+	return ring;
+}
+
+/* printf one record, re-typing every conversion from the stored 64 bits */
+static void ring_print(const struct sys_ring_rec *r, const char *fmt)
+{
+	const char *p = fmt;
+	int n = 0;
+
+	while (*p) {
+		char spec[32];
+		const char *s = p;
+		size_t l = 0;
+		int longarg = 0;
+
+		if (*p != '%' || p[1] == '%') {
+			putchar(*p);
+			p += *p == '%' ? 2 : 1;
+			continue;
+		}
+		spec[l++] = *p++;
+		while (*p && strchr("-+ #0123456789.", *p) && l < sizeof(spec) - 4)
+			spec[l++] = *p++;
+		while (*p && strchr("hlLqjzt", *p))
+			longarg |= *p++ != 'h';
+		if (!*p)
+			break;
+
+		uint64_t v = n < r->nargs && n < SYS_RING_ARGS ? r->arg[n] : 0;
+		char conv = *p++;
+		double d;
+
+		n++;
+		spec[l] = 0;
+		switch (conv) {
+		case 'd': case 'i':
+			strcat(spec, "lld");
+			printf(spec, longarg ? (long long)v : (long long)(int)v);
+			break;
+		case 'u': case 'o': case 'x': case 'X': {
+			char c[] = { 'l', 'l', conv, 0 };
+			strcat(spec, c);
+			printf(spec, longarg ? (unsigned long long)v :
+			       (unsigned long long)(unsigned)v);
+			break;
+		}
+		case 'c':
+			strcat(spec, "c");
+			printf(spec, (int)v);
+			break;
+		case 'p':
+			strcat(spec, "p");
+			printf(spec, (void *)(uintptr_t)v);
+			break;
+		case 's':
+			strcat(spec, "s");
+			printf(spec, v < SYS_RING_STR ? r->str + v : "...");
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+			char c[] = { conv, 0 };
+			strcat(spec, c);
+			memcpy(&d, &v, sizeof(d));
+			printf(spec, d);
+			break;
+		}
+		default:
+			fwrite(s, 1, p - s, stdout);
+		}
+	}
+}
+
+struct ring_event {
+	uint64_t tsc;
+	uint64_t tid;
+	const struct sys_ring_rec *rec;
+	/* per ring: each process may have loaded the image elsewhere */
+	intptr_t delta;
+	double tsc_per_us;
+
+	bool operator<(const ring_event &o) const { return tsc < o.tsc; }
+};
+
+/* ibv_test --ring-decode FILE...: merge the thread rings by timestamp */
+int sys_ring_decode(int argc, char **argv)
+{
+	std::vector<ring_event> events;
+
+	for (int i = 0; i < argc; i++) {
+		const struct sys_ring_hdr *hdr;
+		const struct sys_ring_rec *recs;
+		struct stat st;
+		void *map;
+		int fd;
+
+		fd = open(argv[i], O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+			fprintf(stderr, "%s: can't read\n", argv[i]);
+			return 1;
+		}
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+			return 1;
+		hdr = (const struct sys_ring_hdr *)map;
+		recs = (const struct sys_ring_rec *)(hdr + 1);
+		if (memcmp(hdr->magic, SYS_RING_MAGIC, sizeof(hdr->magic)) ||
+		    strncmp(hdr->stamp, SYS_RING_STAMP, sizeof(hdr->stamp)) ||
+		    sizeof(*hdr) + hdr->size * sizeof(*recs) > (size_t)st.st_size) {
+			fprintf(stderr, "%s: not a ring of this ibv_test build\n", argv[i]);
+			return 1;
+		}
+		for (uint64_t n = hdr->head > hdr->size ? hdr->head - hdr->size : 0;
+		     n < hdr->head; n++) {
+			ring_event e;
+
+			e.rec = &recs[n & (hdr->size - 1)];
+			e.tsc = e.rec->tsc;
+			e.tid = hdr->tid;
+			/* format strings are in our image, only the load address moved */
+			e.delta = (uintptr_t)SYS_RING_MAGIC - hdr->anchor;
+			e.tsc_per_us = hdr->tsc_per_us;
+			events.push_back(e);
+		}
+	}
+
+	std::stable_sort(events.begin(), events.end());
+	for (size_t i = 0; i < events.size(); i++) {
+		const struct sys_ring_rec *r = events[i].rec;
+
+		printf("[ %-8s ] %12.3f %6" PRIu64 " ",
+		       r->level == GTEST_LOG_TRACE ? "TRACE" : "INFO",
+		       (r->tsc - events[0].tsc) / events[i].tsc_per_us,
+		       events[i].tid);
+		ring_print(r, (const char *)((uintptr_t)r->fmt + events[i].delta));
+	}
+	return 0;
+}
@@ -49,12 +49,6 @@
 //#define SZ 1024
 #define SZ 128
 
-template <typename T1, typename T2>
-struct types_2 {
-	typedef T1 QP;
-	typedef T2 CQ;
-};
-
 template <typename T>
 struct base_test : public testing::Test, public ibvt_env {
 	struct ibvt_ctx ctx;
@@ -73,7 +67,9 @@ struct base_test : public testing::Test, public ibvt_env {
 		recv_qp(*this, pd, cq),
 		src_mr(*this, pd, SZ),
 		dst_mr(*this, pd, SZ)
-	{ }
+	{
+		recycle = 1;
+	}
 
 	void send(intptr_t start, size_t length) {
 		EXEC(send_qp.send(src_mr.sge(start, length)));
@@ -101,6 +97,7 @@ struct base_test : public testing::Test, public ibvt_env {
 	}
 
 	virtual void TearDown() {
+		prof_dump();
 		ASSERT_FALSE(HasFailure());
 	}
 };
@@ -108,8 +105,13 @@ struct base_test : public testing::Test, public ibvt_env {
 typedef testing::Types<
 	types_2<ibvt_qp_rc, ibvt_cq>,
 	types_2<ibvt_qp_ud, ibvt_cq>,
+#if HAVE_DECL_IBV_WR_START
+	types_2<ibvt_qp_ex, ibvt_cq>,
+#endif
 	types_2<ibvt_qp_rc, ibvt_cq_event>,
-	types_2<ibvt_qp_ud, ibvt_cq_event>
+	types_2<ibvt_qp_ud, ibvt_cq_event>,
+	types_2<ibvt_qp_rc, ibvt_cq_hybrid>,
+	types_2<ibvt_qp_ud, ibvt_cq_hybrid>
 > base_test_env_list;
 
 TYPED_TEST_CASE(base_test, base_test_env_list);
@@ -136,12 +138,26 @@ TYPED_TEST(base_test, t1) {
 	EXEC(check(2));
 }
 
+TYPED_TEST(base_test, t2) {
+	CHK_SUT(basic);
+	EXEC(recv(0, SZ/2));
+	EXEC(recv(SZ/2, SZ/2));
+	EXEC(send(0, SZ/2));
+	EXEC(send(SZ/2, SZ/2));
+	EXEC(cq.poll(4));
+	EXEC(check(2));
+}
+
 template <typename T>
 struct rdma_test : public base_test<T> {};
 
 typedef testing::Types<
 	types_2<ibvt_qp_rc, ibvt_cq>,
-	types_2<ibvt_qp_rc, ibvt_cq_event>
+#if HAVE_DECL_IBV_WR_START
+	types_2<ibvt_qp_ex, ibvt_cq>,
+#endif
+	types_2<ibvt_qp_rc, ibvt_cq_event>,
+	types_2<ibvt_qp_rc, ibvt_cq_hybrid>
 > rdma_test_env_list;
 
 TYPED_TEST_CASE(rdma_test, rdma_test_env_list);
@@ -198,7 +214,9 @@ struct srq_test : public testing::Test, public ibvt_env {
 		recv_obj(*this, pd, cq, srq),
 		src_mr(*this, pd, SZ),
 		dst_mr(*this, pd, SZ)
-	{ }
+	{
+		recycle = 1;
+	}
 
 	void send(intptr_t start, size_t length) {
 		EXEC(send_qp.send(src_mr.sge(start, length)));
@@ -239,6 +257,7 @@ struct srq_test : public testing::Test, public ibvt_env {
 	}
 
 	virtual void TearDown() {
+		prof_dump();
 		ASSERT_FALSE(HasFailure());
 	}
 };
@@ -451,6 +451,7 @@ struct flow_tag_test : public testing::Test, public ibvt_env {
 	}
 
 	virtual void TearDown() {
+		prof_dump();
 		ASSERT_FALSE(HasFailure());
 	}
 };
@@ -0,0 +1,108 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _ODP_H
+#define _ODP_H
+
+#include <sys/mman.h>
+
+#include "env.h"
+
+#if HAVE_DECL_IBV_PREFETCH_MR
+#define HAVE_PREFETCH 1
+#define IBV_EXP_PREFETCH_WRITE_ACCESS 0
+#elif HAVE_DECL_IBV_EXP_PREFETCH_MR
+#define HAVE_PREFETCH 1
+#define ibv_prefetch_attr ibv_exp_prefetch_attr
+#define ibv_prefetch_mr ibv_exp_prefetch_mr
+#elif HAVE_DECL_IBV_ADVISE_MR
+#define HAVE_PREFETCH 1
+#define HAVE_ADVISE 1
+#else
+#define HAVE_PREFETCH 0
+#endif
+
+struct ibvt_mr_implicit : public ibvt_mr {
+	ibvt_mr_implicit(ibvt_env &e, ibvt_pd &p, long a) :
+		ibvt_mr(e, p, 0, 0, a) {}
+
+	virtual void init() {
+		DO(!(pd.ctx.dev_attr.odp_caps.general_odp_caps & IBV_ODP_SUPPORT_IMPLICIT));
+		EXEC(pd.init());
+		SET(mr, ibv_reg_mr(pd.pd, 0, UINT64_MAX, IBV_ACCESS_ON_DEMAND | access_flags));
+		if (mr)
+			VERBS_TRACE("\t\t\t\t\tibv_reg_mr(pd, 0, 0, %lx) = %x\n", access_flags, mr->lkey);
+	}
+};
+
+#if HAVE_PREFETCH
+struct ibvt_mr_pf : public ibvt_mr {
+	ibvt_mr_pf(ibvt_env &e, ibvt_pd &p, size_t s, intptr_t a, long af) :
+		ibvt_mr(e, p, s, a, af) {}
+
+	virtual void init() {
+		EXEC(ibvt_mr::init());
+
+		if (env.skip)
+			return;
+#if HAVE_ADVISE
+		/* an SGE only covers 4GB, larger MRs are advised in chunks */
+		for (size_t off = 0; off < size; off += 1UL << 30) {
+			struct ibv_sge sge = this->sge(off, std::min<size_t>(size - off, 1UL << 30));
+
+			DO(ibv_advise_mr(pd.pd, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE,
+					 IBV_ADVISE_MR_FLAG_FLUSH, &sge, 1));
+		}
+#else
+		struct ibv_prefetch_attr attr;
+
+		attr.flags = IBV_EXP_PREFETCH_WRITE_ACCESS;
+		attr.addr = buff;
+		attr.length = size;
+		attr.comp_mask = 0;
+		DO(ibv_prefetch_mr(mr, &attr));
+#endif
+	}
+};
+#endif
+
+#if HAVE_DECL_IBV_ACCESS_HUGETLB
+#define ODP_ACCESS_HUGETLB IBV_ACCESS_HUGETLB
+#else
+#define ODP_ACCESS_HUGETLB 0
+#endif
+
+/* hugetlbfs backed, 2MB pages unless IBV_TEST_PAGES asks for 1GB */
+struct ibvt_mr_hp : public ibvt_mr {
+	ibvt_mr_hp(ibvt_env &e, ibvt_pd &p, size_t s, intptr_t a, long af) :
+		ibvt_mr(e, p, s, a, af | ODP_ACCESS_HUGETLB) {
+		pages = std::max<int>(pages, IBVT_PAGES_2M);
+	}
+};
+
+#endif
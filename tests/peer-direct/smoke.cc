@@ -512,6 +512,7 @@ struct peerdirect_test : public testing::Test, public ibvt_env {
 	}
 
 	virtual void TearDown() {
+		prof_dump();
 		if (skip)
 			return;
 		ASSERT_FALSE(HasFailure());
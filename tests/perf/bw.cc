@@ -0,0 +1,233 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_LIMIT_MACROS
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+
+#define BW_MAX_SIZE	(8 << 20)
+#define BW_MAX_DEPTH	4096
+#define BW_ITERS	4096
+/* traffic budget of a single size/depth point */
+#define BW_BYTES	(64 << 20)
+
+/* the passive side of a pair, DC sends land on a DCT and its SRQ */
+template <typename QP>
+struct bw_peer : public QP {
+	bw_peer(ibvt_env &e, ibvt_pd &p, ibvt_cq &c, ibvt_srq &s) :
+		QP(e, p, c) {}
+};
+
+#if HAVE_DC
+template <>
+struct bw_peer<ibvt_qp_dc> : public ibvt_dct {
+	bw_peer(ibvt_env &e, ibvt_pd &p, ibvt_cq &c, ibvt_srq &s) :
+		ibvt_dct(e, p, c, s) {}
+
+	void recv(ibv_sge sge) {
+		EXEC(srq.recv(sge));
+	}
+};
+#endif
+
+template <typename T>
+struct bw_test : public testing::Test, public ibvt_env {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct T::CQ cq;
+	struct T::CQ rcq;
+	struct ibvt_srq srq;
+	struct T::QP send_qp;
+	struct bw_peer<typename T::QP> recv_qp;
+	struct ibvt_mr src_mr;
+	struct ibvt_mr dst_mr;
+
+	size_t max_size;
+	int max_depth;
+	long iters;
+	int sq_depth;
+
+	bw_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		cq(*this, ctx),
+		rcq(*this, ctx),
+		srq(*this, pd, rcq),
+		send_qp(*this, pd, cq),
+		recv_qp(*this, pd, rcq, srq),
+		src_mr(*this, pd, BW_MAX_SIZE + 64),
+		dst_mr(*this, pd, BW_MAX_SIZE + 64),
+		max_size(BW_MAX_SIZE),
+		max_depth(BW_MAX_DEPTH),
+		iters(BW_ITERS),
+		sq_depth(0)
+	{
+		recycle = 1;
+		if (getenv("IBV_TEST_BW_SIZE"))
+			max_size = std::min<size_t>(BW_MAX_SIZE,
+					strtoul(getenv("IBV_TEST_BW_SIZE"), NULL, 0));
+		if (getenv("IBV_TEST_BW_DEPTH"))
+			max_depth = atoi(getenv("IBV_TEST_BW_DEPTH"));
+		if (getenv("IBV_TEST_BW_ITERS"))
+			iters = atol(getenv("IBV_TEST_BW_ITERS"));
+	}
+
+	/* UD posts carry the GRH room in their sge */
+	int pad() {
+		return send_qp.has_rdma() ? 0 : send_qp.hdr_len();
+	}
+
+	size_t mtu_limit() {
+		if (send_qp.has_rdma())
+			return BW_MAX_SIZE;
+		return 128 << ctx.port_attr.active_mtu;
+	}
+
+	void query_depth() {
+		struct ibv_qp_attr attr;
+		struct ibv_qp_init_attr init_attr;
+
+		DO(ibv_query_qp(send_qp.qp, &attr, IBV_QP_CAP, &init_attr));
+		sq_depth = init_attr.cap.max_send_wr;
+	}
+
+	void post(enum ibv_wr_opcode opcode, ibv_sge src, ibv_sge dst) {
+		if (opcode == IBV_WR_SEND) {
+			EXEC(recv_qp.recv(dst));
+			EXEC(send_qp.post_send(src, opcode));
+		} else {
+			EXEC(send_qp.rdma(src, dst, opcode));
+		}
+	}
+
+	void measure(enum ibv_wr_opcode opcode, size_t size, int depth, long n,
+		     double &usec) {
+		std::vector<struct ibv_wc> wcs;
+		struct ibv_sge src = src_mr.sge(0, size + pad());
+		struct ibv_sge dst = dst_mr.sge(0, size + pad());
+		long posted = 0, done = 0;
+		double start = sys_gettime();
+
+		while (done < n) {
+			for (; posted < n && posted - done < depth; posted++)
+				EXEC(post(opcode, src, dst));
+			wcs.resize(posted - done);
+			EXEC(cq.poll_batch(wcs));
+			if (opcode == IBV_WR_SEND)
+				EXEC(rcq.poll(wcs.size()));
+			done += wcs.size();
+		}
+		usec = sys_gettime() - start;
+	}
+
+	void sweep(enum ibv_wr_opcode opcode, const char *name) {
+		size_t limit = std::min(max_size, mtu_limit());
+
+		for (size_t size = 2; size <= limit; size *= 2) {
+			for (int depth = 1; depth <= max_depth; depth *= 4) {
+				long n = std::min<long>(iters, BW_BYTES / size);
+				double usec;
+
+				if (depth > sq_depth || n < depth)
+					break;
+				EXEC(measure(opcode, size, depth, n, usec));
+				VERBS_NOTICE("bw %-5s %8zu bytes depth %4d: "
+					     "%8.3f GB/s %8.3f Mpps\n",
+					     name, size, depth,
+					     n * size / usec / 1e3, n / usec);
+			}
+		}
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		if (skip)
+			return;
+		INIT(send_qp.init());
+		INIT(recv_qp.init());
+		INIT(send_qp.connect(&recv_qp));
+		INIT(recv_qp.connect(&send_qp));
+		INIT(query_depth());
+		INIT(src_mr.fill());
+		INIT(dst_mr.init());
+		INIT(cq.arm());
+		INIT(rcq.arm());
+	}
+
+	virtual void TearDown() {
+		prof_dump();
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+typedef testing::Types<
+	types_2<ibvt_qp_rc, ibvt_cq>,
+	types_2<ibvt_qp_ud, ibvt_cq>,
+#if HAVE_DC
+	types_2<ibvt_qp_dc, ibvt_cq>,
+#endif
+#if HAVE_DECL_IBV_WR_START
+	types_2<ibvt_qp_ex, ibvt_cq>,
+#endif
+	types_2<ibvt_qp_rc, ibvt_cq_event>
+> bw_test_env_list;
+
+TYPED_TEST_CASE(bw_test, bw_test_env_list);
+
+TYPED_TEST(bw_test, DISABLED_send) {
+	CHK_SUT(basic);
+	EXEC(sweep(IBV_WR_SEND, "send"));
+}
+
+TYPED_TEST(bw_test, DISABLED_write) {
+	CHK_SUT(basic);
+	if (!this->send_qp.has_rdma()) SKIP(1);
+	EXEC(sweep(IBV_WR_RDMA_WRITE, "write"));
+}
+
+TYPED_TEST(bw_test, DISABLED_read) {
+	CHK_SUT(basic);
+	if (!this->send_qp.has_rdma()) SKIP(1);
+	EXEC(sweep(IBV_WR_RDMA_READ, "read"));
+}
@@ -0,0 +1,167 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_LIMIT_MACROS
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+
+#if HAVE_DECL_MLX5DV_INIT_OBJ
+
+#define DV_MAX_BATCH	64
+#define DV_ITERS	(1 << 16)
+#define DV_SIZE		64
+
+/*
+ * The same batches of WRs posted through ibv_post_send on one RC pair
+ * and written as WQEs with one doorbell on another; only the posting
+ * is timed, the completions are drained outside of it.
+ */
+struct dv_test : public testing::Test, public ibvt_env {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct ibvt_cq cq;
+	struct ibvt_cq rcq;
+	struct ibvt_qp_rc verbs_qp;
+	struct ibvt_qp_rc verbs_peer;
+	struct ibvt_qp_rc_dv dv_qp;
+	struct ibvt_qp_rc dv_peer;
+	struct ibvt_mr src_mr;
+	struct ibvt_mr dst_mr;
+
+	long iters;
+
+	dv_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		cq(*this, ctx),
+		rcq(*this, ctx),
+		verbs_qp(*this, pd, cq),
+		verbs_peer(*this, pd, rcq),
+		dv_qp(*this, pd, cq),
+		dv_peer(*this, pd, rcq),
+		src_mr(*this, pd, DV_SIZE),
+		dst_mr(*this, pd, DV_SIZE),
+		iters(DV_ITERS)
+	{
+		if (getenv("IBV_TEST_DV_ITERS"))
+			iters = atol(getenv("IBV_TEST_DV_ITERS"));
+		/* every batch size has to run at least once */
+		iters = std::max((long)DV_MAX_BATCH, iters);
+	}
+
+	void measure(ibvt_qp &qp, ibvt_qp &peer, enum ibv_wr_opcode opcode,
+		     int batch, double &ns) {
+		struct ibv_sge src = src_mr.sge(0, DV_SIZE);
+		struct ibv_sge dst = dst_mr.sge(0, DV_SIZE);
+		uint64_t tsc = 0;
+		long n;
+
+		for (n = 0; n + batch <= iters; n += batch) {
+			uint64_t t;
+
+			if (opcode == IBV_WR_SEND)
+				for (int i = 0; i < batch; i++)
+					EXECL(peer.recv(dst));
+			t = sys_rdtsc();
+			for (int i = 0; i < batch; i++)
+				EXECL(qp.rdma_wr(src, dst, opcode));
+			EXECL(qp.post_all_wr());
+			tsc += sys_rdtsc() - t;
+			EXEC(cq.poll(batch));
+			if (opcode == IBV_WR_SEND)
+				EXEC(rcq.poll(batch));
+		}
+		ns = tsc / sys_tsc_per_us() * 1e3 / n;
+	}
+
+	void sweep(enum ibv_wr_opcode opcode, const char *name) {
+		for (int batch = 1; batch <= DV_MAX_BATCH; batch *= 2) {
+			double verbs_ns, dv_ns;
+
+			EXEC(measure(verbs_qp, verbs_peer, opcode, batch, verbs_ns));
+			EXEC(measure(dv_qp, dv_peer, opcode, batch, dv_ns));
+			VERBS_NOTICE("dv %-5s batch %2d: ibv_post_send %6.1f ns/wqe, "
+				     "direct %6.1f ns/wqe\n", name, batch,
+				     verbs_ns, dv_ns);
+		}
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		if (skip)
+			return;
+		INIT(verbs_qp.init());
+		INIT(verbs_peer.init());
+		INIT(dv_qp.init());
+		INIT(dv_peer.init());
+		INIT(verbs_qp.connect(&verbs_peer));
+		INIT(verbs_peer.connect(&verbs_qp));
+		INIT(dv_qp.connect(&dv_peer));
+		INIT(dv_peer.connect(&dv_qp));
+		INIT(src_mr.fill());
+		INIT(dst_mr.init());
+	}
+
+	virtual void TearDown() {
+		prof_dump();
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+TEST_F(dv_test, DISABLED_send) {
+	CHK_SUT(direct_wqe);
+	EXEC(sweep(IBV_WR_SEND, "send"));
+}
+
+TEST_F(dv_test, DISABLED_write) {
+	CHK_SUT(direct_wqe);
+	EXEC(sweep(IBV_WR_RDMA_WRITE, "write"));
+}
+
+TEST_F(dv_test, DISABLED_read) {
+	CHK_SUT(direct_wqe);
+	EXEC(sweep(IBV_WR_RDMA_READ, "read"));
+}
+
+#endif
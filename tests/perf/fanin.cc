@@ -0,0 +1,248 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_LIMIT_MACROS
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+
+#define FANIN_MAX_QPS	4096
+#define FANIN_DEPTH	16
+#define FANIN_ITERS	(1 << 16)
+#define FANIN_SIZE	64
+#define FANIN_BATCH	16
+/* cqe of ibvt_cq::init_attr, bounds what may be in flight per CQ */
+#define FANIN_CQE	0x1000
+
+/*
+ * N RC senders spread over one or a few shared CQs write into N idle
+ * receivers. Senders are fed round-robin and refilled as their
+ * completions arrive, wr_id carries the sender index.
+ */
+struct fanin_test : public testing::Test, public ibvt_env {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct ibvt_cq rcq;
+	struct ibvt_mr src_mr;
+	struct ibvt_mr dst_mr;
+	std::vector<ibvt_cq *> cqs;
+	std::vector<ibvt_qp_rc *> send_qps;
+	std::vector<ibvt_qp_rc *> recv_qps;
+
+	int max_qps;
+	int depth;
+	long iters;
+	size_t size;
+
+	fanin_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		rcq(*this, ctx),
+		src_mr(*this, pd, FANIN_SIZE),
+		dst_mr(*this, pd, FANIN_SIZE),
+		max_qps(FANIN_MAX_QPS),
+		depth(FANIN_DEPTH),
+		iters(FANIN_ITERS),
+		size(FANIN_SIZE)
+	{
+		if (getenv("IBV_TEST_FANIN_QPS"))
+			max_qps = atoi(getenv("IBV_TEST_FANIN_QPS"));
+		if (getenv("IBV_TEST_FANIN_DEPTH"))
+			depth = atoi(getenv("IBV_TEST_FANIN_DEPTH"));
+		if (getenv("IBV_TEST_FANIN_ITERS"))
+			iters = atol(getenv("IBV_TEST_FANIN_ITERS"));
+	}
+
+	virtual ~fanin_test() {
+		for (size_t i = 0; i < send_qps.size(); i++) {
+			delete send_qps[i];
+			delete recv_qps[i];
+		}
+		for (size_t i = 0; i < cqs.size(); i++)
+			delete cqs[i];
+	}
+
+	void add_cqs(int n) {
+		while ((int)cqs.size() < n) {
+			cqs.push_back(new ibvt_cq(*this, ctx));
+			EXECL(cqs.back()->init());
+		}
+	}
+
+	void add_qps(int n) {
+		while ((int)send_qps.size() < n) {
+			ibvt_cq &cq = *cqs[send_qps.size() % cqs.size()];
+			ibvt_qp_rc *s = new ibvt_qp_rc(*this, pd, cq);
+			ibvt_qp_rc *r = new ibvt_qp_rc(*this, pd, rcq);
+
+			send_qps.push_back(s);
+			recv_qps.push_back(r);
+			s->max_send_wr = depth;
+			s->max_recv_wr = 1;
+			r->max_send_wr = 1;
+			r->max_recv_wr = 1;
+			EXECL(s->init());
+			EXECL(r->init());
+			EXECL(s->connect(r));
+			EXECL(r->connect(s));
+		}
+	}
+
+	void post(int i) {
+		struct ibv_sge sge = src_mr.sge(0, size);
+		struct ibv_send_wr wr;
+		struct ibv_send_wr *bad_wr = NULL;
+
+		memset(&wr, 0, sizeof(wr));
+		wr.wr_id = i;
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr._wr_opcode = IBV_WR_RDMA_WRITE;
+		wr._wr_send_flags = IBV_SEND_SIGNALED;
+		wr.wr.rdma.remote_addr = (intptr_t)dst_mr.buff;
+		wr.wr.rdma.rkey = dst_mr.lkey();
+		DO(ibv_post_send(send_qps[i]->qp, &wr, &bad_wr));
+	}
+
+	void measure(int n) {
+		int ncq = cqs.size();
+		std::vector<int> out(n), cq_out(ncq);
+		std::vector<long> count(n);
+		struct ibv_wc wc[FANIN_BATCH];
+		long total = std::max<long>(iters, 8L * n);
+		long posted = 0, done = 0, polls = 0;
+		long room = (long)ncq * FANIN_CQE;
+		uint64_t poll_tsc = 0;
+		double start, usec, tpu = sys_tsc_per_us();
+		int rr = 0;
+
+		start = sys_gettime();
+		while (done < total) {
+			for (int scan = 0; scan < n && room && posted < total;
+			     scan++, rr = (rr + 1) % n) {
+				int c = rr % ncq;
+
+				if (out[rr] >= depth || cq_out[c] >= FANIN_CQE)
+					continue;
+				EXEC(post(rr));
+				out[rr]++;
+				cq_out[c]++;
+				room--;
+				posted++;
+				scan = 0;
+			}
+			for (int c = 0; c < ncq; c++) {
+				uint64_t t = sys_rdtsc();
+				int k = cqs[c]->try_poll_batch(wc, FANIN_BATCH);
+
+				poll_tsc += sys_rdtsc() - t;
+				polls++;
+				ASSERT_GE(k, 0);
+				for (int j = 0; j < k; j++) {
+					ASSERT_FALSE(wc[j].status) << ibv_wc_status_str(wc[j].status);
+					out[wc[j].wr_id]--;
+					count[wc[j].wr_id]++;
+				}
+				cq_out[c] -= k;
+				room += k;
+				done += k;
+			}
+		}
+		usec = sys_gettime() - start;
+
+		double sum = 0, sum2 = 0;
+		long lo = count[0], hi = count[0];
+
+		for (int i = 0; i < n; i++) {
+			sum += count[i];
+			sum2 += (double)count[i] * count[i];
+			lo = std::min(lo, count[i]);
+			hi = std::max(hi, count[i]);
+		}
+		VERBS_NOTICE("fanin %6d qps %d cqs: %8.3f Mpps, fairness %.3f "
+			     "(min %ld max %ld), poll %6.1f ns/call %6.1f ns/cqe\n",
+			     n, ncq, total / usec, sum * sum / (n * sum2), lo, hi,
+			     poll_tsc / tpu * 1e3 / polls,
+			     poll_tsc / tpu * 1e3 / total);
+	}
+
+	void sweep(int ncq) {
+		int limit = std::min(max_qps, ctx.dev_attr_orig->max_qp / 2);
+
+		EXEC(add_cqs(ncq));
+		for (int n = 1; n <= limit; n *= 4) {
+			double start = sys_gettime();
+			int created = send_qps.size();
+
+			EXEC(add_qps(n));
+			if (n > created)
+				VERBS_INFO("fanin %6d qps: %.1f usec per qp pair\n", n,
+					   (sys_gettime() - start) / (n - created));
+			EXEC(measure(n));
+		}
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		if (skip)
+			return;
+		INIT(rcq.init());
+		INIT(src_mr.fill());
+		INIT(dst_mr.init());
+	}
+
+	virtual void TearDown() {
+		prof_dump();
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+TEST_F(fanin_test, DISABLED_t0) {
+	CHK_SUT(basic);
+	EXEC(sweep(1));
+}
+
+TEST_F(fanin_test, DISABLED_t1) {
+	CHK_SUT(basic);
+	EXEC(sweep(4));
+}
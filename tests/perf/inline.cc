@@ -0,0 +1,172 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_LIMIT_MACROS
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+
+#define INL_MIN_SIZE	8
+#define INL_MAX_SIZE	256
+#define INL_ITERS	(1 << 16)
+#define INL_DEPTH	64
+
+/*
+ * Two RC pairs over the same CQs, one created with max_inline_data of
+ * INL_MAX_SIZE and one without, so ibvt_qp::post_send/rdma pick
+ * IBV_SEND_INLINE for the first and the lkey for the second.
+ */
+struct inline_test : public testing::Test, public ibvt_env {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct ibvt_cq cq;
+	struct ibvt_cq rcq;
+	struct ibvt_qp_rc lkey_qp;
+	struct ibvt_qp_rc lkey_peer;
+	struct ibvt_qp_rc inl_qp;
+	struct ibvt_qp_rc inl_peer;
+	struct ibvt_mr src_mr;
+	struct ibvt_mr dst_mr;
+
+	long iters;
+
+	inline_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		cq(*this, ctx),
+		rcq(*this, ctx),
+		lkey_qp(*this, pd, cq),
+		lkey_peer(*this, pd, rcq),
+		inl_qp(*this, pd, cq),
+		inl_peer(*this, pd, rcq),
+		src_mr(*this, pd, INL_MAX_SIZE),
+		dst_mr(*this, pd, INL_MAX_SIZE),
+		iters(INL_ITERS)
+	{
+		recycle = 1;
+		lkey_qp.max_inline_data = 0;
+		inl_qp.max_inline_data = INL_MAX_SIZE;
+		if (getenv("IBV_TEST_INLINE_ITERS"))
+			iters = atol(getenv("IBV_TEST_INLINE_ITERS"));
+	}
+
+	void post(ibvt_qp &qp, ibvt_qp &peer, enum ibv_wr_opcode opcode,
+		  size_t size, uint64_t &tsc) {
+		uint64_t t;
+
+		if (opcode == IBV_WR_SEND)
+			EXECL(peer.recv(dst_mr.sge(0, size)));
+		t = sys_rdtsc();
+		if (opcode == IBV_WR_SEND)
+			EXECL(qp.post_send(src_mr.sge(0, size), opcode));
+		else
+			EXECL(qp.rdma(src_mr.sge(0, size), dst_mr.sge(0, size), opcode));
+		tsc += sys_rdtsc() - t;
+	}
+
+	void measure(ibvt_qp &qp, ibvt_qp &peer, enum ibv_wr_opcode opcode,
+		     size_t size, double &mpps, double &ns) {
+		std::vector<struct ibv_wc> wcs;
+		long posted = 0, done = 0;
+		uint64_t tsc = 0;
+		double start = sys_gettime();
+
+		while (done < iters) {
+			for (; posted < iters && posted - done < INL_DEPTH; posted++)
+				EXEC(post(qp, peer, opcode, size, tsc));
+			wcs.resize(posted - done);
+			EXEC(cq.poll_batch(wcs));
+			if (opcode == IBV_WR_SEND)
+				EXEC(rcq.poll(wcs.size()));
+			done += wcs.size();
+		}
+		mpps = iters / (sys_gettime() - start);
+		ns = tsc / sys_tsc_per_us() * 1e3 / iters;
+	}
+
+	void sweep(enum ibv_wr_opcode opcode, const char *name) {
+		for (size_t size = INL_MIN_SIZE; size <= INL_MAX_SIZE; size *= 2) {
+			double lkey_mpps, lkey_ns, inl_mpps, inl_ns;
+
+			EXEC(measure(lkey_qp, lkey_peer, opcode, size,
+				     lkey_mpps, lkey_ns));
+			EXEC(measure(inl_qp, inl_peer, opcode, size,
+				     inl_mpps, inl_ns));
+			VERBS_NOTICE("inline %-5s %4zu bytes: lkey %8.3f Mpps "
+				     "%6.1f ns/post, inline %8.3f Mpps %6.1f ns/post\n",
+				     name, size, lkey_mpps, lkey_ns,
+				     inl_mpps, inl_ns);
+		}
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		if (skip)
+			return;
+		INIT(lkey_qp.init());
+		INIT(lkey_peer.init());
+		INIT(inl_qp.init());
+		INIT(inl_peer.init());
+		INIT(lkey_qp.connect(&lkey_peer));
+		INIT(lkey_peer.connect(&lkey_qp));
+		INIT(inl_qp.connect(&inl_peer));
+		INIT(inl_peer.connect(&inl_qp));
+		INIT(src_mr.fill());
+		INIT(dst_mr.init());
+	}
+
+	virtual void TearDown() {
+		prof_dump();
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+TEST_F(inline_test, DISABLED_send) {
+	CHK_SUT(basic);
+	EXEC(sweep(IBV_WR_SEND, "send"));
+}
+
+TEST_F(inline_test, DISABLED_write) {
+	CHK_SUT(basic);
+	EXEC(sweep(IBV_WR_RDMA_WRITE, "write"));
+}
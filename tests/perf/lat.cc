@@ -0,0 +1,240 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_LIMIT_MACROS
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+
+#define LAT_MAX_SIZE	(64 << 10)
+#define LAT_ITERS	10000
+#define LAT_WARMUP	100
+
+/*
+ * Both ends of the ping-pong live in this thread: the ping side owns
+ * send_qp/cq/src_mr, the pong side recv_qp/rcq/dst_mr. Each MR holds
+ * a TX half at 0 and an RX half at LAT_MAX_SIZE.
+ */
+template <typename T>
+struct lat_test : public testing::Test, public ibvt_env {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct T::CQ cq;
+	struct T::CQ rcq;
+	struct T::QP send_qp;
+	struct T::QP recv_qp;
+	struct ibvt_mr src_mr;
+	struct ibvt_mr dst_mr;
+
+	size_t max_size;
+	long iters;
+	std::vector<uint64_t> rtt;
+	/* HCA clock figures with IBV_TEST_CQ_TS, no host jitter in them */
+	std::vector<double> hw;
+	double last_hw;
+
+	lat_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		cq(*this, ctx),
+		rcq(*this, ctx),
+		send_qp(*this, pd, cq),
+		recv_qp(*this, pd, rcq),
+		src_mr(*this, pd, 2 * LAT_MAX_SIZE),
+		dst_mr(*this, pd, 2 * LAT_MAX_SIZE),
+		max_size(LAT_MAX_SIZE),
+		iters(LAT_ITERS),
+		last_hw(0)
+	{
+		recycle = 1;
+		if (getenv("IBV_TEST_LAT_SIZE"))
+			max_size = std::min<size_t>(LAT_MAX_SIZE,
+					strtoul(getenv("IBV_TEST_LAT_SIZE"), NULL, 0));
+		if (getenv("IBV_TEST_LAT_ITERS"))
+			iters = std::max(1L, atol(getenv("IBV_TEST_LAT_ITERS")));
+	}
+
+	void wait_byte(volatile char *p, char tag) {
+		long long retries = POLL_RETRIES;
+
+		while (*p != tag && --retries);
+		ASSERT_GT(retries, 0) << "tag " << (int)tag;
+	}
+
+	/* post to the pong's receive CQE: one way */
+	void send_round(size_t size) {
+		uint64_t t0 = rcq.timestamps ? rcq.hw_clock() : 0;
+
+		EXEC(send_qp.send(src_mr.sge(0, size)));
+		EXEC(rcq.poll(1));
+		if (rcq.timestamps)
+			last_hw = rcq.ts_ns(rcq.wc_ts[0] - t0) / 1e3;
+		EXEC(recv_qp.send(dst_mr.sge(0, size)));
+		EXEC(cq.poll(2));
+	}
+
+	/* receives always cover the whole RX half */
+	void send_prime() {
+		EXEC(send_qp.recv(src_mr.sge(LAT_MAX_SIZE, LAT_MAX_SIZE)));
+		EXEC(recv_qp.recv(dst_mr.sge(LAT_MAX_SIZE, LAT_MAX_SIZE)));
+	}
+
+	void send_rearm() {
+		EXEC(rcq.poll(1));
+		EXEC(send_prime());
+	}
+
+	/* post to the ping's write CQE: data out, ACK back */
+	void write_round(size_t size, char tag) {
+		uint64_t t0 = cq.timestamps ? cq.hw_clock() : 0;
+
+		src_mr.buff[size - 1] = tag;
+		EXEC(send_qp.rdma(src_mr.sge(0, size),
+				  dst_mr.sge(LAT_MAX_SIZE, size),
+				  IBV_WR_RDMA_WRITE));
+		EXEC(wait_byte(dst_mr.buff + LAT_MAX_SIZE + size - 1, tag));
+		dst_mr.buff[size - 1] = tag;
+		EXEC(recv_qp.rdma(dst_mr.sge(0, size),
+				  src_mr.sge(LAT_MAX_SIZE, size),
+				  IBV_WR_RDMA_WRITE));
+		EXEC(cq.poll(1));
+		if (cq.timestamps)
+			last_hw = cq.ts_ns(cq.wc_ts[0] - t0) / 1e3;
+		EXEC(wait_byte(src_mr.buff + LAT_MAX_SIZE + size - 1, tag));
+	}
+
+	void write_rearm() {
+		EXEC(rcq.poll(1));
+	}
+
+	void report(const char *name, size_t size) {
+		double tpu = sys_tsc_per_us();
+		size_t n = rtt.size();
+
+		if (!n)
+			return;
+		std::sort(rtt.begin(), rtt.end());
+		VERBS_NOTICE("lat %-5s %6zu bytes: min %7.2f p50 %7.2f "
+			     "p99 %7.2f p99.9 %7.2f max %7.2f usec\n",
+			     name, size, rtt[0] / tpu, rtt[n / 2] / tpu,
+			     rtt[n * 99 / 100] / tpu,
+			     rtt[n * 999 / 1000] / tpu, rtt[n - 1] / tpu);
+		if (hw.empty())
+			return;
+		n = hw.size();
+		std::sort(hw.begin(), hw.end());
+		VERBS_NOTICE("lat %-5s %6zu bytes: hw %s min %7.2f p50 %7.2f "
+			     "p99 %7.2f max %7.2f usec\n", name, size,
+			     !strcmp(name, "send") ? "one-way" : "rtt", hw[0],
+			     hw[n / 2], hw[n * 99 / 100], hw[n - 1]);
+	}
+
+	void pingpong(enum ibv_wr_opcode opcode, const char *name) {
+		if (opcode == IBV_WR_SEND)
+			EXEC(send_prime());
+		for (size_t size = 2; size <= max_size; size *= 4) {
+			rtt.clear();
+			hw.clear();
+			for (long i = -LAT_WARMUP; i < iters; i++) {
+				char tag = (i + LAT_WARMUP) % 127 + 1;
+				uint64_t start = sys_rdtsc();
+
+				if (opcode == IBV_WR_SEND)
+					EXEC(send_round(size));
+				else
+					EXEC(write_round(size, tag));
+				if (i >= 0)
+					rtt.push_back(sys_rdtsc() - start);
+				if (i >= 0 && cq.timestamps)
+					hw.push_back(last_hw);
+				if (opcode == IBV_WR_SEND)
+					EXEC(send_rearm());
+				else
+					EXEC(write_rearm());
+			}
+			EXEC(report(name, size));
+		}
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		if (skip)
+			return;
+		INIT(send_qp.init());
+		INIT(recv_qp.init());
+		INIT(send_qp.connect(&recv_qp));
+		INIT(recv_qp.connect(&send_qp));
+		INIT(src_mr.init());
+		INIT(dst_mr.init());
+		INIT(cq.check_ts());
+		INIT(cq.arm());
+		INIT(rcq.arm());
+	}
+
+	virtual void TearDown() {
+		prof_dump();
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+typedef testing::Types<
+	types_2<ibvt_qp_rc, ibvt_cq>,
+	types_2<ibvt_qp_rc, ibvt_cq_event>,
+	types_2<ibvt_qp_rc, ibvt_cq_hybrid>
+#if HAVE_DECL_MLX5DV_INIT_OBJ
+	, types_2<ibvt_qp_rc_dv, ibvt_cq>,
+	types_2<ibvt_qp_rc_bf, ibvt_cq>
+#endif
+> lat_test_env_list;
+
+TYPED_TEST_CASE(lat_test, lat_test_env_list);
+
+TYPED_TEST(lat_test, DISABLED_send) {
+	CHK_SUT(basic);
+	EXEC(pingpong(IBV_WR_SEND, "send"));
+}
+
+TYPED_TEST(lat_test, DISABLED_write) {
+	CHK_SUT(basic);
+	EXEC(pingpong(IBV_WR_RDMA_WRITE, "write"));
+}
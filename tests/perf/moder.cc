@@ -0,0 +1,186 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_LIMIT_MACROS
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+
+#define MODER_MAX_COUNT	64
+#define MODER_MAX_PERIOD 512
+#define MODER_DEPTH	64
+#define MODER_ITERS	(1 << 16)
+#define MODER_SIZE	64
+
+/*
+ * RDMA_WRITE stream kept MODER_DEPTH deep, reaped from an event CQ
+ * whose completion moderation is swept over count x period.
+ */
+struct moder_test : public testing::Test, public ibvt_env {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct ibvt_cq_event cq;
+	struct ibvt_cq rcq;
+	struct ibvt_qp_rc send_qp;
+	struct ibvt_qp_rc recv_qp;
+	struct ibvt_mr src_mr;
+	struct ibvt_mr dst_mr;
+
+	int max_count;
+	int max_period;
+	int depth;
+	long iters;
+	std::vector<uint64_t> posted_at;
+	std::vector<uint64_t> lat;
+
+	moder_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		cq(*this, ctx),
+		rcq(*this, ctx),
+		send_qp(*this, pd, cq),
+		recv_qp(*this, pd, rcq),
+		src_mr(*this, pd, MODER_SIZE),
+		dst_mr(*this, pd, MODER_SIZE),
+		max_count(MODER_MAX_COUNT),
+		max_period(MODER_MAX_PERIOD),
+		depth(MODER_DEPTH),
+		iters(MODER_ITERS)
+	{
+		if (getenv("IBV_TEST_MODER_COUNT"))
+			max_count = atoi(getenv("IBV_TEST_MODER_COUNT"));
+		if (getenv("IBV_TEST_MODER_PERIOD"))
+			max_period = atoi(getenv("IBV_TEST_MODER_PERIOD"));
+		if (getenv("IBV_TEST_MODER_DEPTH"))
+			depth = atoi(getenv("IBV_TEST_MODER_DEPTH"));
+		if (getenv("IBV_TEST_MODER_ITERS"))
+			iters = atol(getenv("IBV_TEST_MODER_ITERS"));
+		send_qp.max_send_wr = depth;
+	}
+
+	/* user + system time of this thread, sleeping in the event
+	 * channel does not count */
+	static double cpu_usec() {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+	}
+
+	void measure(int count, int period) {
+		std::vector<struct ibv_wc> wcs;
+		struct ibv_sge src = src_mr.sge(0, MODER_SIZE);
+		struct ibv_sge dst = dst_mr.sge(0, MODER_SIZE);
+		long posted = 0, done = 0, events = cq.num_cq_events;
+		double start, cpu, tpu = sys_tsc_per_us();
+		size_t n;
+
+		EXEC(cq.moderate(count, period));
+		posted_at.resize(iters);
+		lat.clear();
+		cpu = cpu_usec();
+		start = sys_gettime();
+		while (done < iters) {
+			for (; posted < iters && posted - done < depth; posted++) {
+				posted_at[posted] = sys_rdtsc();
+				EXEC(send_qp.rdma(src, dst, IBV_WR_RDMA_WRITE));
+			}
+			/* sleep for the event, then reap what it covers */
+			EXEC(cq.wait_event());
+			wcs.resize(posted - done);
+			EXEC(cq.poll_batch(wcs));
+			for (size_t i = 0; i < wcs.size(); i++)
+				lat.push_back(sys_rdtsc() - posted_at[done++]);
+		}
+		start = sys_gettime() - start;
+		cpu = cpu_usec() - cpu;
+		events = cq.num_cq_events - events;
+
+		if (HasFailure())
+			return;
+		std::sort(lat.begin(), lat.end());
+		n = lat.size();
+		VERBS_NOTICE("moder count %3d period %4d: %9.0f events/s "
+			     "%6.1f cqes/event %5.1f%% cpu, "
+			     "p50 %7.2f p99 %7.2f usec\n",
+			     count, period, events / start * 1e6,
+			     events ? (double)iters / events : 0.0,
+			     cpu / start * 100,
+			     lat[n / 2] / tpu, lat[n * 99 / 100] / tpu);
+	}
+
+	/* count 1 is an event per CQE; past that a period always closes
+	 * the window the count alone would leave open at the end */
+	void sweep() {
+		EXEC(measure(1, 0));
+		for (int period = 8; period <= max_period; period *= 8)
+			for (int count = 4; count <= std::min(max_count, depth);
+			     count *= 4)
+				EXEC(measure(count, period));
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		if (skip)
+			return;
+		INIT(send_qp.init());
+		INIT(recv_qp.init());
+		INIT(send_qp.connect(&recv_qp));
+		INIT(recv_qp.connect(&send_qp));
+		INIT(src_mr.fill());
+		INIT(dst_mr.init());
+		INIT(cq.moderate(0, 0));
+		INIT(cq.arm());
+	}
+
+	virtual void TearDown() {
+		prof_dump();
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+TEST_F(moder_test, DISABLED_write) {
+	CHK_SUT(cq_moderation);
+	EXEC(sweep());
+}
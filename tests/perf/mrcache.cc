@@ -0,0 +1,242 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_LIMIT_MACROS
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+
+#define MRC_BUFS	8
+#define MRC_BUF_SIZE	(1 << 20)
+#define MRC_ITERS	4096
+#define MRC_MSG		64
+
+/* registers memory it does not own, like a send buffer handed to MPI */
+struct ibvt_mr_slice : public ibvt_mr {
+	ibvt_mr_slice(ibvt_env &e, ibvt_pd &p, char *b, size_t s) :
+		ibvt_mr(e, p, s) { buff = b; }
+
+	virtual void init_mmap() {}
+};
+
+/*
+ * Slices of MRC_BUFS application buffers are registered, used for one
+ * RDMA_WRITE and released again, with and without the MR cache.
+ */
+struct mrcache_test : public testing::Test, public ibvt_env {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct ibvt_cq cq;
+	struct ibvt_cq rcq;
+	struct ibvt_qp_rc send_qp;
+	struct ibvt_qp_rc recv_qp;
+	struct ibvt_mr dst_mr;
+
+	std::vector<char *> bufs;
+	long iters;
+	int was_enabled;
+
+	mrcache_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		cq(*this, ctx),
+		rcq(*this, ctx),
+		send_qp(*this, pd, cq),
+		recv_qp(*this, pd, rcq),
+		dst_mr(*this, pd, MRC_MSG),
+		iters(MRC_ITERS),
+		was_enabled(mr_cache().enabled)
+	{
+		if (getenv("IBV_TEST_MRC_ITERS"))
+			iters = atol(getenv("IBV_TEST_MRC_ITERS"));
+	}
+
+	~mrcache_test() {
+		for (size_t i = 0; i < bufs.size(); i++)
+			munmap(bufs[i], MRC_BUF_SIZE);
+		mr_cache().enabled = was_enabled;
+	}
+
+	void map(char *&buf, void *at = NULL) {
+		buf = (char *)mmap(at, MRC_BUF_SIZE, PROT_READ|PROT_WRITE,
+				   MAP_PRIVATE|MAP_ANON|(at ? MAP_FIXED : 0),
+				   -1, 0);
+		ASSERT_NE(buf, MAP_FAILED);
+		sys_fill_pattern(buf, 0, MRC_BUF_SIZE, 0);
+	}
+
+	/* whole buffers first, then ever smaller slices inside them */
+	void slice(long i, char *&buf, size_t &len) {
+		long round = i / MRC_BUFS;
+
+		len = MRC_BUF_SIZE >> (round % 4);
+		buf = bufs[i % MRC_BUFS] +
+		      (round * PAGE) % (MRC_BUF_SIZE - len + PAGE) / PAGE * PAGE;
+	}
+
+	void use(char *buf, size_t len) {
+		ibvt_mr_slice mr(*this, pd, buf, len);
+
+		EXECL(mr.init());
+		EXEC(send_qp.rdma(mr.sge(0, MRC_MSG), dst_mr.sge(),
+				  IBV_WR_RDMA_WRITE));
+		EXEC(cq.poll());
+		ASSERT_EQ(0, memcmp(buf, dst_mr.buff, MRC_MSG));
+	}
+
+	void measure(int enabled, long &misses) {
+		ibvt_mr_cache &c = mr_cache();
+		long hits = c.hits;
+		double saved = c.saved_usec, start;
+
+		c.enabled = enabled;
+		misses = c.misses;
+		start = sys_gettime();
+		for (long i = 0; i < iters; i++) {
+			char *buf;
+			size_t len;
+
+			slice(i, buf, len);
+			EXEC(use(buf, len));
+		}
+		misses = c.misses - misses;
+		VERBS_NOTICE("mr cache %-3s: %7.2f usec per use, %6ld hits "
+			     "%6ld misses, %9.0f usec of ibv_reg_mr saved\n",
+			     enabled ? "on" : "off",
+			     (sys_gettime() - start) / iters,
+			     c.hits - hits, misses, c.saved_usec - saved);
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		if (skip)
+			return;
+		INIT(send_qp.init());
+		INIT(recv_qp.init());
+		INIT(send_qp.connect(&recv_qp));
+		INIT(recv_qp.connect(&send_qp));
+		INIT(dst_mr.init());
+		bufs.resize(MRC_BUFS);
+		for (int i = 0; i < MRC_BUFS; i++)
+			INIT(map(bufs[i]));
+	}
+
+	virtual void TearDown() {
+		prof_dump();
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+/* only the first, whole buffer registrations miss */
+TEST_F(mrcache_test, DISABLED_reuse) {
+	long misses;
+
+	CHK_SUT(basic);
+	EXEC(measure(0, misses));
+	EXEC(measure(1, misses));
+	ASSERT_EQ(std::min<long>(iters, MRC_BUFS), misses);
+}
+
+TEST_F(mrcache_test, munmap) {
+	ibvt_mr_cache &c = mr_cache();
+	long misses;
+
+	CHK_SUT(basic);
+	c.enabled = 1;
+	EXEC(use(bufs[0], MRC_BUF_SIZE));
+	EXEC(use(bufs[0], MRC_MSG));
+	misses = c.misses;
+
+	/* new pages at the same address need a new registration */
+	ASSERT_EQ(0, munmap(bufs[0], MRC_BUF_SIZE));
+	EXEC(map(bufs[0], bufs[0]));
+	bufs[0][0] ^= 0xff;
+	EXEC(use(bufs[0], MRC_MSG));
+	ASSERT_EQ(misses + 1, c.misses);
+
+	/* so do zero pages behind a dropped range */
+	ASSERT_EQ(0, madvise(bufs[0], MRC_BUF_SIZE, MADV_DONTNEED));
+	bufs[0][0] ^= 0xff;
+	EXEC(use(bufs[0], MRC_MSG));
+	ASSERT_EQ(misses + 2, c.misses);
+}
+
+/* a freed ibvt_mr leaves its mapping registered for the next one */
+TEST_F(mrcache_test, mapping) {
+	ibvt_mr_cache &c = mr_cache();
+	long hits;
+	char *buff;
+
+	CHK_SUT(basic);
+	c.enabled = 1;
+	{
+		ibvt_mr mr(*this, pd, MRC_BUF_SIZE);
+
+		EXECL(mr.init());
+		buff = mr.buff;
+	}
+	hits = c.hits;
+	{
+		ibvt_mr mr(*this, pd, MRC_BUF_SIZE);
+
+		EXECL(mr.init());
+		ASSERT_EQ(buff, mr.buff);
+		EXECL(mr.fill());
+		EXEC(send_qp.rdma(mr.sge(0, MRC_MSG), dst_mr.sge(),
+				  IBV_WR_RDMA_WRITE));
+		EXEC(cq.poll());
+		ASSERT_EQ(0, memcmp(mr.buff, dst_mr.buff, MRC_MSG));
+	}
+	ASSERT_EQ(hits + 1, c.hits);
+}
+
+/* permissions may be widened, on-demand paging may not */
+TEST_F(mrcache_test, access) {
+	const long rw = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE;
+
+	CHK_SUT(basic);
+	ASSERT_TRUE(ibvt_mr_cache::covers(rw, IBV_ACCESS_LOCAL_WRITE));
+	ASSERT_FALSE(ibvt_mr_cache::covers(IBV_ACCESS_LOCAL_WRITE, rw));
+	ASSERT_FALSE(ibvt_mr_cache::covers(rw | IBV_ACCESS_ON_DEMAND, rw));
+	ASSERT_FALSE(ibvt_mr_cache::covers(rw, rw | IBV_ACCESS_ON_DEMAND));
+}
@@ -0,0 +1,316 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_LIMIT_MACROS
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+#include "../odp/odp.h"
+
+#define REGMR_MIN	(1UL << 12)
+#define REGMR_MAX	(1UL << 30)
+#define REGMR_ITERS	16
+#define REGMR_BYTES	(1UL << 28)
+
+/*
+ * Times ibv_reg_mr of an MR class from after its memory is mapped and
+ * faulted in, and ibv_dereg_mr before it is unmapped.
+ */
+template <typename MR>
+struct ibvt_mr_timed : public MR {
+	double start;
+	double reg_usec;
+	double dereg_usec;
+
+	template <typename... A>
+	ibvt_mr_timed(A&&... a) :
+		MR(std::forward<A>(a)...), start(0), reg_usec(0), dereg_usec(0) {}
+
+	virtual void init_mmap() {
+		EXEC(MR::init_mmap());
+		for (size_t i = 0; i < this->mem_size; i += PAGE)
+			this->mem[i] = 0;
+		start = sys_gettime();
+	}
+
+	virtual void init() {
+		start = sys_gettime();
+		EXEC(MR::init());
+		reg_usec = sys_gettime() - start;
+	}
+
+	virtual void fini() {
+		start = sys_gettime();
+		DO(ibv_dereg_mr(this->mr));
+		dereg_usec = sys_gettime() - start;
+		this->mr = NULL;
+	}
+};
+
+enum regmr_kind {
+	REGMR_4K,
+	REGMR_THP,
+	REGMR_2M,
+	REGMR_1G,
+	REGMR_ODP,
+	REGMR_IMPLICIT,
+	REGMR_PREFETCH,
+	REGMR_KINDS
+};
+
+static const char *regmr_names[REGMR_KINDS] = {
+	"4k", "thp", "hugetlb-2m", "hugetlb-1g", "odp", "implicit",
+	"odp+prefetch"
+};
+
+/*
+ * ibv_reg_mr/ibv_dereg_mr cost from REGMR_MIN up to IBV_TEST_REGMR_SIZE
+ * (1GB, e.g. 64GB on a dedicated host) for pinned 4K, THP, 2MB and 1GB
+ * hugetlbfs pages and for explicit and prefetched ODP on IBV_TEST_PAGES
+ * pages; sizes which do not fit in free memory, huge pages or
+ * RLIMIT_MEMLOCK are left out. Implicit ODP covers the whole address
+ * space whatever the size, so it is timed once.
+ */
+struct regmr_test : public testing::Test, public ibvt_env {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+
+	size_t max_size;
+	long iters;
+	int was_enabled;
+
+	regmr_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		max_size(REGMR_MAX),
+		iters(REGMR_ITERS),
+		was_enabled(mr_cache().enabled)
+	{
+		if (getenv("IBV_TEST_REGMR_SIZE"))
+			max_size = strtoul(getenv("IBV_TEST_REGMR_SIZE"), NULL, 0);
+		if (getenv("IBV_TEST_REGMR_ITERS"))
+			iters = atol(getenv("IBV_TEST_REGMR_ITERS"));
+		/* every registration has to reach the driver */
+		mr_cache().enabled = 0;
+	}
+
+	~regmr_test() {
+		mr_cache().enabled = was_enabled;
+	}
+
+	long meminfo_kb(const char *var) {
+		char *hit;
+
+		init_ram();
+		hit = strstr(meminfo, var);
+		return hit ? atol(hit + strlen(var)) : 0;
+	}
+
+	int kind_pages(int kind) {
+		switch (kind) {
+		case REGMR_4K:
+			return IBVT_PAGES_4K;
+		case REGMR_THP:
+			return IBVT_PAGES_THP;
+		case REGMR_2M:
+			return IBVT_PAGES_2M;
+		case REGMR_1G:
+			return IBVT_PAGES_1G;
+		default:
+			return ibvt_abstract_mr::pages_env();
+		}
+	}
+
+	bool fits(int kind, size_t len) {
+		int odp = ctx.dev_attr.odp_caps.general_odp_caps;
+		int pages = kind_pages(kind);
+		size_t page = ibvt_abstract_mr::page_size(pages);
+		struct rlimit rl;
+
+		switch (kind) {
+		case REGMR_ODP:
+			if (!(odp & IBV_ODP_SUPPORT))
+				return false;
+			break;
+		case REGMR_IMPLICIT:
+			return odp & IBV_ODP_SUPPORT_IMPLICIT;
+		case REGMR_PREFETCH:
+			if (!HAVE_PREFETCH || !(odp & IBV_ODP_SUPPORT))
+				return false;
+			break;
+		}
+		if (pages == IBVT_PAGES_THP) {
+			char mode[64] = "[never]";
+			int fd = open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY);
+
+			if (fd >= 0) {
+				if (read(fd, mode, sizeof(mode) - 1) < 0)
+					mode[0] = 0;
+				close(fd);
+			}
+			if (strstr(mode, "[never]"))
+				return false;
+		}
+		if (page > PAGE && (len % page ||
+		    len / page > (size_t)ibvt_abstract_mr::huge_free(page)))
+			return false;
+		/* the buffer is faulted in before it is registered, leave
+		 * at least half of the available memory to everyone else */
+		if (page == PAGE &&
+		    len > (size_t)meminfo_kb("MemAvailable:") * 1024 / 2)
+			return false;
+		if (kind == REGMR_ODP || kind == REGMR_PREFETCH)
+			return true;
+		/* CAP_IPC_LOCK pins past RLIMIT_MEMLOCK */
+		return !geteuid() || (!getrlimit(RLIMIT_MEMLOCK, &rl) &&
+		       (rl.rlim_cur == RLIM_INFINITY || len <= rl.rlim_cur));
+	}
+
+	template <typename MR, typename... A>
+	void once(int pages, double &reg, double &dereg, A... a) {
+		ibvt_mr_timed<MR> mr(*this, pd, a...);
+
+		mr.pages = pages;
+		EXECL(mr.init());
+		EXECL(mr.fini());
+		reg += mr.reg_usec;
+		dereg += mr.dereg_usec;
+	}
+
+	void once(int kind, size_t len, double &reg, double &dereg) {
+		long af = IBV_ACCESS_LOCAL_WRITE |
+			  IBV_ACCESS_REMOTE_READ |
+			  IBV_ACCESS_REMOTE_WRITE;
+		int pages = kind_pages(kind);
+
+		switch (kind) {
+		case REGMR_4K:
+		case REGMR_THP:
+			EXEC(once<ibvt_mr>(pages, reg, dereg, len, (intptr_t)0, af));
+			break;
+		case REGMR_2M:
+		case REGMR_1G:
+			EXEC(once<ibvt_mr_hp>(pages, reg, dereg, len, (intptr_t)0, af));
+			break;
+		case REGMR_ODP:
+			EXEC(once<ibvt_mr>(pages, reg, dereg, len, (intptr_t)0,
+					   af | IBV_ACCESS_ON_DEMAND));
+			break;
+		case REGMR_IMPLICIT:
+			EXEC(once<ibvt_mr_implicit>(pages, reg, dereg, af));
+			break;
+#if HAVE_PREFETCH
+		case REGMR_PREFETCH:
+			EXEC(once<ibvt_mr_pf>(pages, reg, dereg, len, (intptr_t)0,
+					      af | IBV_ACCESS_ON_DEMAND));
+			break;
+#endif
+		}
+	}
+
+	/* usec per ibv_reg_mr/ibv_dereg_mr, "-" where the kind does not fit */
+	void cell(int kind, size_t len, char *out, size_t out_len) {
+		long n = std::max<long>(1, std::min<long>(iters, REGMR_BYTES / len));
+		double reg = 0, dereg = 0;
+
+		snprintf(out, out_len, "-");
+		if (!fits(kind, len))
+			return;
+		for (long i = 0; i < n; i++)
+			EXEC(once(kind, len, reg, dereg));
+		snprintf(out, out_len, "%.1f/%.1f", reg / n, dereg / n);
+	}
+
+	void sweep() {
+		char line[256], size[16], out[32];
+		int pos;
+
+		pos = snprintf(line, sizeof(line), "%8s", "size");
+		for (int k = 0; k < REGMR_KINDS; k++) {
+			if (k == REGMR_IMPLICIT)
+				continue;
+			pos += snprintf(line + pos, sizeof(line) - pos, " %15s",
+					regmr_names[k]);
+		}
+		VERBS_NOTICE("%s  (usec reg/dereg)\n", line);
+
+		for (size_t len = REGMR_MIN; len <= max_size; len <<= 2) {
+			if (len >= 1UL << 30)
+				snprintf(size, sizeof(size), "%zuGB", len >> 30);
+			else if (len >= 1UL << 20)
+				snprintf(size, sizeof(size), "%zuMB", len >> 20);
+			else
+				snprintf(size, sizeof(size), "%zuKB", len >> 10);
+
+			pos = snprintf(line, sizeof(line), "%8s", size);
+			for (int k = 0; k < REGMR_KINDS; k++) {
+				if (k == REGMR_IMPLICIT)
+					continue;
+				EXEC(cell(k, len, out, sizeof(out)));
+				pos += snprintf(line + pos, sizeof(line) - pos,
+						" %15s", out);
+			}
+			VERBS_NOTICE("%s\n", line);
+		}
+
+		EXEC(cell(REGMR_IMPLICIT, REGMR_MIN, out, sizeof(out)));
+		VERBS_NOTICE("%8s %15s\n", regmr_names[REGMR_IMPLICIT], out);
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		INIT(pd.init());
+	}
+
+	virtual void TearDown() {
+		prof_dump();
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+TEST_F(regmr_test, DISABLED_sweep) {
+	CHK_SUT(basic);
+	EXEC(sweep());
+}
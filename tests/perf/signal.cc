@@ -0,0 +1,157 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_LIMIT_MACROS
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+
+#define SIG_MAX_PERIOD	256
+#define SIG_DEPTH	512
+#define SIG_ITERS	(1 << 18)
+#define SIG_SIZE	64
+#define SIG_BATCH	16
+
+/*
+ * RDMA_WRITE stream with the SQ kept full, where only every N-th WR
+ * asks for a CQE and each CQE gives back the slots it covers.
+ */
+struct signal_test : public testing::Test, public ibvt_env {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct ibvt_cq cq;
+	struct ibvt_cq rcq;
+	struct ibvt_qp_rc send_qp;
+	struct ibvt_qp_rc recv_qp;
+	struct ibvt_mr src_mr;
+	struct ibvt_mr dst_mr;
+
+	int max_period;
+	long iters;
+
+	signal_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		cq(*this, ctx),
+		rcq(*this, ctx),
+		send_qp(*this, pd, cq),
+		recv_qp(*this, pd, rcq),
+		src_mr(*this, pd, SIG_SIZE),
+		dst_mr(*this, pd, SIG_SIZE),
+		max_period(SIG_MAX_PERIOD),
+		iters(SIG_ITERS)
+	{
+		recycle = 1;
+		send_qp.max_send_wr = SIG_DEPTH;
+		if (getenv("IBV_TEST_SIG_PERIOD"))
+			max_period = atoi(getenv("IBV_TEST_SIG_PERIOD"));
+		if (getenv("IBV_TEST_SIG_ITERS"))
+			iters = atol(getenv("IBV_TEST_SIG_ITERS"));
+	}
+
+	void measure(int period, double &usec, long &cqes) {
+		std::vector<struct ibv_wc> wcs(SIG_BATCH);
+		struct ibv_sge src = src_mr.sge(0, SIG_SIZE);
+		struct ibv_sge dst = dst_mr.sge(0, SIG_SIZE);
+		long posted = 0;
+		double start;
+
+		send_qp.sig_period = period;
+		send_qp.sig_pending = 0;
+		send_qp.sq_used = 0;
+		cqes = 0;
+		start = sys_gettime();
+		while (posted < iters || send_qp.sq_used) {
+			for (; posted < iters && send_qp.sq_room() > 0; posted++) {
+				if (posted == iters - 1)
+					send_qp.sig_flush();
+				EXEC(send_qp.rdma(src, dst, IBV_WR_RDMA_WRITE));
+			}
+			wcs.resize(SIG_BATCH);
+			EXEC(cq.poll_batch(wcs));
+			for (size_t i = 0; i < wcs.size(); i++)
+				send_qp.reclaim(wcs[i]);
+			cqes += wcs.size();
+		}
+		usec = sys_gettime() - start;
+		send_qp.sig_period = 0;
+	}
+
+	void sweep() {
+		double base = 0;
+
+		for (int period = 1; period <= max_period; period *= 2) {
+			double usec;
+			long cqes;
+
+			EXEC(measure(period, usec, cqes));
+			if (period == 1)
+				base = usec;
+			VERBS_NOTICE("signal every %4d: %8.3f Mpps, %8ld cqes, "
+				     "%5.2fx\n", period, iters / usec, cqes,
+				     base / usec);
+		}
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		if (skip)
+			return;
+		INIT(send_qp.init());
+		INIT(recv_qp.init());
+		INIT(send_qp.connect(&recv_qp));
+		INIT(recv_qp.connect(&send_qp));
+		INIT(src_mr.fill());
+		INIT(dst_mr.init());
+	}
+
+	virtual void TearDown() {
+		prof_dump();
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+TEST_F(signal_test, DISABLED_write) {
+	CHK_SUT(basic);
+	EXEC(sweep());
+}
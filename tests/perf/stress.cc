@@ -0,0 +1,394 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_LIMIT_MACROS
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+
+#define STRESS_POSTERS	4
+#define STRESS_POLLERS	2
+#define STRESS_ITERS	(1 << 16)
+#define STRESS_DEPTH	64
+#define STRESS_SIZE	64
+#define STRESS_BATCH	16
+/* cqe of ibvt_cq::init_attr */
+#define STRESS_CQE	0x1000
+
+enum stress_mode {
+	STRESS_QP_PER_THREAD,
+	STRESS_SHARED_QP,
+	STRESS_SHARED_CQ,
+};
+
+struct stress_test;
+
+/* per thread counters, a cache line apart so the threads do not share them */
+struct stress_thread {
+	stress_test *t;
+	pthread_t thread;
+	int idx;
+	int cpu;
+	long ops;
+	long calls;
+	uint64_t tsc;
+	long contended;
+	uint64_t wait_tsc;
+} ALIGN(CACHE_LINE);
+
+struct stress_credit {
+	long inflight;
+} ALIGN(CACHE_LINE);
+
+/*
+ * M poster threads feed RDMA_WRITEs into idle receivers and K poller
+ * threads drain the send CQs, every thread pinned to its own core.
+ * Posters either own a QP each, share one QP behind a mutex, or own a
+ * QP each on one shared CQ. The worker loops use the raw verbs of the
+ * ibvt_qp/ibvt_cq objects; errors are counted and checked afterwards
+ * from the test thread.
+ */
+struct stress_test : public testing::Test, public ibvt_env {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct ibvt_cq rcq;
+	struct ibvt_mr src_mr;
+	struct ibvt_mr dst_mr;
+	std::vector<ibvt_cq *> cqs;
+	std::vector<ibvt_qp_rc *> send_qps;
+	std::vector<ibvt_qp_rc *> recv_qps;
+	std::vector<stress_credit> credits;
+	pthread_mutex_t qp_lock;
+
+	int posters;
+	int pollers;
+	long iters;
+	int depth;
+	enum stress_mode mode;
+
+	int active;
+	int yield;
+	long total;
+	long done;
+	long errors;
+	int stop;
+
+	stress_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		rcq(*this, ctx),
+		src_mr(*this, pd, STRESS_SIZE),
+		dst_mr(*this, pd, STRESS_SIZE),
+		posters(STRESS_POSTERS),
+		pollers(STRESS_POLLERS),
+		iters(STRESS_ITERS),
+		depth(STRESS_DEPTH),
+		mode(STRESS_QP_PER_THREAD)
+	{
+		pthread_mutex_init(&qp_lock, NULL);
+		if (getenv("IBV_TEST_STRESS_POSTERS"))
+			posters = std::max(1, atoi(getenv("IBV_TEST_STRESS_POSTERS")));
+		if (getenv("IBV_TEST_STRESS_POLLERS"))
+			pollers = std::max(1, atoi(getenv("IBV_TEST_STRESS_POLLERS")));
+		if (getenv("IBV_TEST_STRESS_ITERS"))
+			iters = atol(getenv("IBV_TEST_STRESS_ITERS"));
+	}
+
+	virtual ~stress_test() {
+		for (size_t i = 0; i < send_qps.size(); i++) {
+			delete send_qps[i];
+			delete recv_qps[i];
+		}
+		for (size_t i = 0; i < cqs.size(); i++)
+			delete cqs[i];
+		pthread_mutex_destroy(&qp_lock);
+	}
+
+	void setup(enum stress_mode m) {
+		int nqp = m == STRESS_SHARED_QP ? 1 : posters;
+		int ncq = m == STRESS_QP_PER_THREAD ? posters : 1;
+
+		mode = m;
+		/* whatever may be in flight on one CQ has to fit into it */
+		depth = std::min(depth, STRESS_CQE / (nqp / ncq));
+		for (int i = 0; i < ncq; i++) {
+			cqs.push_back(new ibvt_cq(*this, ctx));
+			EXECL(cqs.back()->init());
+		}
+		for (int i = 0; i < nqp; i++) {
+			ibvt_qp_rc *s = new ibvt_qp_rc(*this, pd, *cqs[i % ncq]);
+			ibvt_qp_rc *r = new ibvt_qp_rc(*this, pd, rcq);
+
+			send_qps.push_back(s);
+			recv_qps.push_back(r);
+			s->max_send_wr = depth;
+			s->max_recv_wr = 1;
+			r->max_send_wr = 1;
+			r->max_recv_wr = 1;
+			EXECL(s->init());
+			EXECL(r->init());
+			EXECL(s->connect(r));
+			EXECL(r->connect(s));
+		}
+		credits.resize(nqp);
+	}
+
+	/* reserve a send queue slot, given back by the poller */
+	bool take(int q) {
+		long *p = &credits[q].inflight;
+
+		if (__atomic_add_fetch(p, 1, __ATOMIC_ACQUIRE) <= depth)
+			return true;
+		__atomic_sub_fetch(p, 1, __ATOMIC_RELEASE);
+		return false;
+	}
+
+	int post(stress_thread &th, int q) {
+		struct ibv_sge sge = src_mr.sge(0, STRESS_SIZE);
+		struct ibv_send_wr wr;
+		struct ibv_send_wr *bad_wr = NULL;
+		uint64_t t;
+		int ret;
+
+		memset(&wr, 0, sizeof(wr));
+		wr.wr_id = q;
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr._wr_opcode = IBV_WR_RDMA_WRITE;
+		wr._wr_send_flags = IBV_SEND_SIGNALED;
+		wr.wr.rdma.remote_addr = (intptr_t)dst_mr.buff;
+		wr.wr.rdma.rkey = dst_mr.lkey();
+
+		t = sys_rdtsc();
+		if (mode == STRESS_SHARED_QP &&
+		    pthread_mutex_trylock(&qp_lock)) {
+			th.contended++;
+			pthread_mutex_lock(&qp_lock);
+			th.wait_tsc += sys_rdtsc() - t;
+		}
+		ret = ibv_post_send(send_qps[q]->qp, &wr, &bad_wr);
+		if (mode == STRESS_SHARED_QP)
+			pthread_mutex_unlock(&qp_lock);
+		th.tsc += sys_rdtsc() - t;
+		th.calls++;
+		return ret;
+	}
+
+	void poster(stress_thread &th) {
+		int q = mode == STRESS_SHARED_QP ? 0 : th.idx;
+
+		while (th.ops < iters && !__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+			if (!take(q)) {
+				if (yield)
+					sched_yield();
+				continue;
+			}
+			if (post(th, q)) {
+				__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+				__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			th.ops++;
+		}
+	}
+
+	void poller(stress_thread &th) {
+		struct ibv_wc wc[STRESS_BATCH];
+		int ncq = std::min<int>(cqs.size(), active);
+		long retries = POLL_RETRIES;
+		int c = th.idx % ncq;
+
+		while (__atomic_load_n(&done, __ATOMIC_RELAXED) < total &&
+		       !__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+			uint64_t t = sys_rdtsc();
+			int k = cqs[c]->try_poll_batch(wc, STRESS_BATCH);
+
+			th.tsc += sys_rdtsc() - t;
+			th.calls++;
+			if (k < 0 || !--retries) {
+				__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+				__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			for (int j = 0; j < k; j++) {
+				if (wc[j].status)
+					__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+				__atomic_sub_fetch(&credits[wc[j].wr_id].inflight, 1,
+						   __ATOMIC_RELEASE);
+			}
+			if (k) {
+				retries = POLL_RETRIES;
+				th.ops += k;
+				__atomic_add_fetch(&done, k, __ATOMIC_RELAXED);
+			} else if (yield) {
+				sched_yield();
+			}
+			/* a poller owns CQs c, c + K, ... of the active ones */
+			if (ncq > pollers) {
+				c += pollers;
+				if (c >= ncq)
+					c = th.idx % pollers;
+			}
+		}
+	}
+
+	static void *poster_main(void *arg) {
+		stress_thread *th = (stress_thread *)arg;
+
+		th->cpu = sys_pin_cpu(th->idx);
+		th->t->poster(*th);
+		return NULL;
+	}
+
+	static void *poller_main(void *arg) {
+		stress_thread *th = (stress_thread *)arg;
+
+		th->cpu = sys_pin_cpu(th->t->posters + th->idx);
+		th->t->poller(*th);
+		return NULL;
+	}
+
+	void report(const char *name, std::vector<stress_thread> &post_th,
+		    std::vector<stress_thread> &poll_th, double usec) {
+		double tpu = sys_tsc_per_us();
+		long calls = 0, polls = 0, contended = 0;
+		uint64_t post_tsc = 0, poll_tsc = 0, wait_tsc = 0;
+
+		for (size_t i = 0; i < post_th.size(); i++) {
+			calls += post_th[i].calls;
+			post_tsc += post_th[i].tsc;
+			contended += post_th[i].contended;
+			wait_tsc += post_th[i].wait_tsc;
+			VERBS_INFO("stress %s poster %zu cpu %d: %ld posts\n", name,
+				   i, post_th[i].cpu, post_th[i].ops);
+		}
+		for (size_t i = 0; i < poll_th.size(); i++) {
+			polls += poll_th[i].calls;
+			poll_tsc += poll_th[i].tsc;
+			VERBS_INFO("stress %s poller %zu cpu %d: %ld cqes\n", name,
+				   i, poll_th[i].cpu, poll_th[i].ops);
+		}
+		VERBS_NOTICE("stress %-6s %2zu posters %2zu pollers: %8.3f Mpps, "
+			     "post %7.1f ns, poll %7.1f ns, lock contended "
+			     "%5.1f%% wait %7.1f ns\n",
+			     name, post_th.size(), poll_th.size(), total / usec,
+			     post_tsc / tpu * 1e3 / std::max(calls, 1L),
+			     poll_tsc / tpu * 1e3 / std::max(polls, 1L),
+			     100.0 * contended / std::max(calls, 1L),
+			     wait_tsc / tpu * 1e3 / std::max(contended, 1L));
+	}
+
+	void measure(const char *name, int m) {
+		std::vector<stress_thread> post_th(m), poll_th(pollers);
+		double start;
+
+		active = m;
+		/* with fewer cores than threads idle spinning starves the rest */
+		yield = m + pollers > sysconf(_SC_NPROCESSORS_ONLN);
+		total = m * iters;
+		done = 0;
+		errors = 0;
+		stop = 0;
+		for (size_t i = 0; i < credits.size(); i++)
+			credits[i].inflight = 0;
+
+		start = sys_gettime();
+		for (int i = 0; i < m; i++) {
+			post_th[i].t = this;
+			post_th[i].idx = i;
+			ASSERT_EQ(0, pthread_create(&post_th[i].thread, NULL,
+						    poster_main, &post_th[i]));
+		}
+		for (int i = 0; i < pollers; i++) {
+			poll_th[i].t = this;
+			poll_th[i].idx = i;
+			ASSERT_EQ(0, pthread_create(&poll_th[i].thread, NULL,
+						    poller_main, &poll_th[i]));
+		}
+		for (int i = 0; i < m; i++)
+			pthread_join(post_th[i].thread, NULL);
+		for (int i = 0; i < pollers; i++)
+			pthread_join(poll_th[i].thread, NULL);
+		ASSERT_EQ(0, errors);
+		ASSERT_EQ(total, done);
+		EXEC(report(name, post_th, poll_th, sys_gettime() - start));
+	}
+
+	void sweep(enum stress_mode m, const char *name) {
+		EXEC(setup(m));
+		for (int n = 1; n < posters; n *= 2)
+			EXEC(measure(name, n));
+		EXEC(measure(name, posters));
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		if (skip)
+			return;
+		INIT(rcq.init());
+		INIT(src_mr.fill());
+		INIT(dst_mr.init());
+	}
+
+	virtual void TearDown() {
+		prof_dump();
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+TEST_F(stress_test, DISABLED_qp_per_thread) {
+	CHK_SUT(basic);
+	EXEC(sweep(STRESS_QP_PER_THREAD, "qp"));
+}
+
+TEST_F(stress_test, DISABLED_shared_qp) {
+	CHK_SUT(basic);
+	EXEC(sweep(STRESS_SHARED_QP, "shqp"));
+}
+
+TEST_F(stress_test, DISABLED_shared_cq) {
+	CHK_SUT(basic);
+	EXEC(sweep(STRESS_SHARED_CQ, "shcq"));
+}
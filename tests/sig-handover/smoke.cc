@@ -263,7 +263,7 @@ struct sig_test_base : public testing::Test, public SD, public ibvt_env {
 			ibv_send_wr wr;
 			ibv_exp_sig_attrs sig;
 			ibv_sge data;
-		} *wr = (__cfg_wr *)calloc(1, sizeof(*wr));
+		} *wr = (__cfg_wr *)alloc_wr(sizeof(*wr));
 
 		wr->sig.check_mask = this->check_mask();
 		wr->sig.mem = mem;
@@ -295,7 +295,7 @@ struct sig_test_base : public testing::Test, public SD, public ibvt_env {
 	}
 
 	virtual void linv_wr(ibvt_mr &sig_mr, int sign = 0) {
-		struct ibv_send_wr *wr = (ibv_send_wr *)calloc(1, sizeof(*wr));
+		struct ibv_send_wr *wr = (ibv_send_wr *)alloc_wr(sizeof(*wr));
 
 		wr->exp_opcode = IBV_EXP_WR_LOCAL_INV;
 		wr->exp_send_flags = IBV_EXP_SEND_SOLICITED | IBV_EXP_SEND_FENCE;
@@ -356,6 +356,7 @@ struct sig_test_base : public testing::Test, public SD, public ibvt_env {
 	}
 
 	virtual void TearDown() {
+		prof_dump();
 		ASSERT_FALSE(HasFailure());
 	}
 };
@@ -702,8 +703,7 @@ TEST_F(sig_test_t10dif, b0) {
 			EXEC(linv_wr(this->strip_mr));
 		}
 		EXEC(send_qp.post_all_wr());
-		for (long i = 0; i < N; i++)
-			EXEC(cq.poll());
+		EXEC(cq.poll(N));
 		EXEC(dst_mr.check());
 	}
 }
@@ -721,8 +721,7 @@ TEST_F(sig_test_t10dif, b1) {
 			EXEC(linv_wr(this->strip_mr));
 		}
 		EXEC(send_qp.post_all_wr());
-		for (long i = 0; i < N; i++)
-			EXEC(cq.poll());
+		EXEC(cq.poll(N));
 
 		EXEC(dst_mr.check());
 	}
@@ -741,8 +740,7 @@ TEST_F(sig_test_t10dif, b2) {
 			EXEC(linv_wr(this->strip_mr));
 		}
 		EXEC(send_qp.post_all_wr());
-		for (long i = 0; i < N; i++)
-			EXEC(cq.poll());
+		EXEC(cq.poll(N));
 
 		EXEC(dst_mr.check());
 	}
@@ -761,8 +759,7 @@ TEST_F(sig_test_t10dif, b3) {
 			EXEC(linv_wr(this->strip_mr));
 		}
 		EXEC(send_qp.post_all_wr());
-		for (long i = 0; i < N; i++)
-			EXEC(cq.poll());
+		EXEC(cq.poll(N));
 
 		EXEC(dst_mr.check());
 	}
@@ -786,8 +783,7 @@ TEST_F(sig_test_t10dif, b4) {
 			EXEC(linv_wr(this->strip_mr));
 		}
 		EXEC(send_qp.post_all_wr());
-		for (long i = 0; i < N; i++)
-			EXEC(cq.poll());
+		EXEC(cq.poll(N));
 
 		EXEC(dst_mr.check());
 	}
@@ -807,8 +803,7 @@ TEST_F(sig_test_t10dif, b5) {
 			EXEC(linv_wr(this->strip_mr, 1));
 		}
 		EXEC(send_qp.post_all_wr());
-		for (long i = 0; i < N; i++)
-			EXEC(cq.poll());
+		EXEC(cq.poll(N));
 
 		EXEC(dst_mr.check());
 	}
@@ -828,8 +823,7 @@ TEST_F(sig_test_t10dif, b5o) {
 			EXEC(linv_wr(this->strip_mr, 1));
 		}
 		EXEC(send_qp.post_all_wr());
-		for (long i = 0; i < N; i++)
-			EXEC(cq.poll());
+		EXEC(cq.poll(N));
 
 		EXEC(dst_mr.check());
 	}
@@ -539,6 +539,7 @@ struct tag_matching : public testing::Test, public T::Base {
 	}
 
 	virtual void TearDown() {
+		this->prof_dump();
 		ASSERT_FALSE(HasFailure());
 	}
 };
@@ -393,6 +393,7 @@ struct tag_matching : public testing::TestWithParam<int>, public ibvt_env {
 	}
 
 	virtual void TearDown() {
+		prof_dump();
 		ASSERT_FALSE(HasFailure());
 	}
 };
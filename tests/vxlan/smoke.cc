@@ -564,6 +564,7 @@ struct vxlan_test : public testing::Test, public ibvt_env {
 	}
 
 	virtual void TearDown() {
+		prof_dump();
 		ASSERT_FALSE(HasFailure());
 	}
 };